@@ -0,0 +1,410 @@
+// Microbenchmarks for the hot paths of the interpreter: the scanner, the
+// reader, the compiler, the VM and the printer.
+//
+//   mal_bench [--filter substring] [--min-time seconds] [--repeat n] [--json]
+//
+// Every benchmark runs on inputs generated the same way each time. An
+// operation is repeated until a sample takes at least the minimum time, and
+// the median of several samples is reported, along with the heap
+// allocations each operation made and, where it reads or writes text, its
+// throughput. --json prints the results in a form that is easy to compare
+// between builds.
+
+#include "mal.hpp"
+#include "token.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+// Every allocation in the process goes through here, so that the benchmarks
+// can tell how many an operation made.
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete[](void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+  const char *filter = nullptr;
+  double minTime = 0.2; // Seconds each sample runs for at least.
+  int repeat = 5;       // Samples taken of each benchmark.
+  bool json = false;
+};
+
+struct Result {
+  std::string name;
+  uint64_t iterations; // Operations per sample.
+  double nsPerOp;
+  double allocsPerOp;
+  double bytesPerOp; // Text read or written by each operation, if any.
+};
+
+// An operation, and optionally work to do before each one that shouldn't be
+// timed. With setup, each operation is timed on its own, so operations that
+// need it should take well over a microsecond.
+struct Benchmark {
+  const char *name;
+  std::function<void()> op;
+  std::function<void()> setup;
+  double bytesPerOp;
+};
+
+struct Sample {
+  double ns;
+  uint64_t allocs;
+};
+
+static Sample runSample(const Benchmark &b, uint64_t iterations) {
+  Sample s{0, 0};
+  if (!b.setup) {
+    auto allocs = allocations.load(std::memory_order_relaxed);
+    auto start = Clock::now();
+    for (uint64_t i = 0; i < iterations; i++) {
+      b.op();
+    }
+    auto end = Clock::now();
+    s.ns = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               end - start)
+               .count();
+    s.allocs = allocations.load(std::memory_order_relaxed) - allocs;
+    return s;
+  }
+  for (uint64_t i = 0; i < iterations; i++) {
+    b.setup();
+    auto allocs = allocations.load(std::memory_order_relaxed);
+    auto start = Clock::now();
+    b.op();
+    auto end = Clock::now();
+    s.allocs += allocations.load(std::memory_order_relaxed) - allocs;
+    s.ns += (double)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                end - start)
+                .count();
+  }
+  return s;
+}
+
+static Result measure(const Benchmark &b, const Options &opts) {
+  // Find how many operations fill a sample, warming up along the way.
+  uint64_t iterations = 1;
+  for (;;) {
+    auto s = runSample(b, iterations);
+    if (s.ns >= opts.minTime * 1e9 || iterations >= (1ull << 40)) {
+      break;
+    }
+    auto scale = s.ns > 0 ? opts.minTime * 1e9 / s.ns : 100.0;
+    iterations = (uint64_t)((double)iterations * std::clamp(scale, 2.0, 100.0));
+  }
+
+  std::vector<Sample> samples;
+  for (int i = 0; i < opts.repeat; i++) {
+    samples.push_back(runSample(b, iterations));
+  }
+  std::sort(samples.begin(), samples.end(),
+            [](const Sample &x, const Sample &y) { return x.ns < y.ns; });
+  auto &median = samples[samples.size() / 2];
+  return Result{b.name, iterations, median.ns / (double)iterations,
+                (double)median.allocs / (double)iterations, b.bytesPerOp};
+}
+
+static void check(bool ok, MALState &state, const char *what) {
+  if (!ok) {
+    std::fprintf(stderr, "%s failed: %s\n", what, state.get_error().c_str());
+    std::exit(1);
+  }
+}
+
+// Reads, compiles and runs a form, leaving its value in register r.
+static void run(MALState &state, std::string src, int r = 0) {
+  check(state.read_str(src, r), state, "read_str");
+  check(state.compile(r), state, "compile");
+  check(state.eval(r), state, "eval");
+}
+
+// A large program, as one form, using every kind of token.
+static std::string programText(int n) {
+  std::string s = "[";
+  for (int i = 0; i < n; i++) {
+    auto k = std::to_string(i);
+    s += "(def! f" + k + " (fn* (a b & more) (let* (c (+ a " + k +
+         ") d (* b 2.5)) (if (< c d) {:key" + k + " \"str\\n" + k +
+         "\"} [c d 'sym" + k + " nil true false]))))\n";
+  }
+  s += "]";
+  return s;
+}
+
+// Source laid out like hand written code, with names, numbers, strings and
+// indentation of varying lengths. Unlike programText, whose one line repeats,
+// where each token ends can't be learnt by the branch predictor.
+static std::string sourceText(size_t size) {
+  static const char *const names[] = {"a",     "x",     "acc",    "fn*",
+                                      "let*",  "if",    "def!",   "count",
+                                      "first", "rest",  "cons",   "conj",
+                                      "nil",   "true",  "helper", "do"};
+  std::minstd_rand rng(42);
+  auto pick = [&](unsigned n) { return (unsigned)(rng() % n); };
+  std::string s;
+  while (s.size() < size) {
+    switch (pick(10)) {
+    case 0:
+    case 1:
+      s += '(';
+      break;
+    case 2:
+    case 3:
+      s += ')';
+      break;
+    case 4:
+      s += pick(2) ? '[' : ']';
+      break;
+    case 5:
+      s += std::to_string(rng() % 100000);
+      break;
+    case 6:
+      s += '"' + std::string(pick(40), 's') + '"';
+      break;
+    case 7:
+      s += ':';
+      [[fallthrough]];
+    default:
+      s += names[pick(16)];
+      if (pick(2)) {
+        s += "-" + std::to_string(pick(1000));
+      }
+    }
+    switch (pick(5)) {
+    case 0:
+      s += '\n' + std::string(pick(16), ' ');
+      break;
+    case 1:
+      break;
+    default:
+      s += ' ';
+    }
+  }
+  return s;
+}
+
+// A function with a body typical of library code, to compile.
+static std::string functionText(int n) {
+  std::string s = "(fn* (x y) (do";
+  for (int i = 0; i < n; i++) {
+    auto k = std::to_string(i);
+    s += " (let* (a" + k + " (+ x " + k + ") b (- y a" + k + ")) (if (< a" +
+         k + " b) (list a" + k + " b \"s\") (vec [x y :k" + k + "])))";
+  }
+  s += "))";
+  return s;
+}
+
+static std::vector<Benchmark> benchmarks() {
+  std::vector<Benchmark> ret;
+
+  // The states and inputs live as long as the benchmarks.
+  static auto program = programText(5000);
+  static auto source = sourceText(1 << 20);
+  static auto function = functionText(200);
+  static MALState reading, compiling, loops, building, lets, printing;
+  static std::string scratch, out;
+
+  ret.push_back({"scanner/peek",
+                 [] {
+                   Scanner scanner(program);
+                   while (scanner.peek().type != TokenType::EOFToken) {
+                     scanner.scan();
+                   }
+                 },
+                 nullptr, (double)program.size()});
+  ret.push_back({"scanner/source",
+                 [] {
+                   Scanner scanner(source);
+                   while (scanner.peek().type != TokenType::EOFToken) {
+                     scanner.scan();
+                   }
+                 },
+                 nullptr, (double)source.size()});
+
+  // Reading builds the form in the arena, which only compiling resets, so
+  // each read is preceded by compiling nil.
+  ret.push_back({"read_str/program",
+                 [] {
+                   check(reading.read_str(program, 0), reading, "read_str");
+                 },
+                 [] {
+                   scratch = "nil";
+                   check(reading.read_str(scratch, 0), reading, "read_str");
+                   check(reading.compile(0), reading, "compile");
+                 },
+                 (double)program.size()});
+
+  ret.push_back({"compile/function",
+                 [] { check(compiling.compile(0), compiling, "compile"); },
+                 [] {
+                   check(compiling.read_str(function, 0), compiling,
+                         "read_str");
+                 },
+                 (double)function.size()});
+
+  // eval runs the last form compiled again each time.
+  run(loops, "(def! sum (fn* (n acc) (if (= n 0) acc "
+             "(sum (- n 1) (+ acc n)))))");
+  run(loops, "(def! fib (fn* (n) (if (< n 2) n "
+             "(+ (fib (- n 1)) (fib (- n 2))))))");
+  ret.push_back({"eval/sum-loop",
+                 [] { check(loops.eval(0), loops, "eval"); },
+                 [] {
+                   scratch = "(sum 10000 0)";
+                   check(loops.read_str(scratch, 0), loops, "read_str");
+                   check(loops.compile(0), loops, "compile");
+                 },
+                 0});
+  ret.push_back({"eval/fib",
+                 [] { check(loops.eval(0), loops, "eval"); },
+                 [] {
+                   scratch = "(fib 20)";
+                   check(loops.read_str(scratch, 0), loops, "read_str");
+                   check(loops.compile(0), loops, "compile");
+                 },
+                 0});
+
+  run(building, "(def! build-vec (fn* (n v) (if (= n 0) v "
+                "(build-vec (- n 1) (conj v n)))))");
+  run(building, "(def! build-map (fn* (n m) (if (= n 0) m "
+                "(build-map (- n 1) (assoc m n (list n))))))");
+  ret.push_back({"eval/build-vector",
+                 [] { check(building.eval(0), building, "eval"); },
+                 [] {
+                   scratch = "(build-vec 10000 [])";
+                   check(building.read_str(scratch, 0), building, "read_str");
+                   check(building.compile(0), building, "compile");
+                 },
+                 0});
+  ret.push_back({"eval/build-map",
+                 [] { check(building.eval(0), building, "eval"); },
+                 [] {
+                   scratch = "(build-map 10000 {})";
+                   check(building.read_str(scratch, 0), building, "read_str");
+                   check(building.compile(0), building, "compile");
+                 },
+                 0});
+
+  run(lets, "(def! lets (fn* (n acc) (if (= n 0) acc "
+            "(let* (a (+ n 1) b (* a 2) c (- b a) d (let* (e (+ c acc)) e)) "
+            "(lets (- n 1) (- d c))))))");
+  ret.push_back({"eval/let-loop",
+                 [] { check(lets.eval(0), lets, "eval"); },
+                 [] {
+                   scratch = "(lets 10000 0)";
+                   check(lets.read_str(scratch, 0), lets, "read_str");
+                   check(lets.compile(0), lets, "compile");
+                 },
+                 0});
+
+  // A structure holding every kind of value, in register 0.
+  run(printing, "(def! item (fn* (n) {:id n :name \"item\\t\" "
+                ":tags [:a :b n] :ratio 0.25 :next (list n nil true)}))");
+  run(printing, "(def! items (fn* (n v) (if (= n 0) v "
+                "(items (- n 1) (conj v (item n))))))");
+  run(printing, "(items 10000 [])");
+  printing.print_str(0, out);
+  ret.push_back({"print_str/structure",
+                 [] {
+                   out.clear();
+                   printing.print_str(0, out);
+                 },
+                 nullptr, (double)out.size()});
+
+  return ret;
+}
+
+static void printJSON(const std::vector<Result> &results, const Options &opts) {
+  std::printf("{\n  \"build_type\": \"%s\",\n  \"min_time\": %g,\n"
+              "  \"repeat\": %d,\n  \"benchmarks\": [",
+              MAL_BUILD_TYPE, opts.minTime, opts.repeat);
+  for (size_t i = 0; i < results.size(); i++) {
+    auto &r = results[i];
+    std::printf("%s\n    {\"name\": \"%s\", \"iterations\": %llu, "
+                "\"ns_per_op\": %.1f, \"allocs_per_op\": %.1f, "
+                "\"bytes_per_op\": %.0f, \"mb_per_s\": %.1f}",
+                i ? "," : "", r.name.c_str(),
+                (unsigned long long)r.iterations, r.nsPerOp, r.allocsPerOp,
+                r.bytesPerOp, r.bytesPerOp * 1e3 / r.nsPerOp);
+  }
+  std::printf("\n  ]\n}\n");
+}
+
+static void printTable(const std::vector<Result> &results) {
+  std::printf("%-22s %12s %14s %12s %10s\n", "benchmark", "iterations",
+              "ns/op", "allocs/op", "MB/s");
+  for (auto &r : results) {
+    std::printf("%-22s %12llu %14.1f %12.1f", r.name.c_str(),
+                (unsigned long long)r.iterations, r.nsPerOp, r.allocsPerOp);
+    if (r.bytesPerOp > 0) {
+      std::printf(" %10.1f", r.bytesPerOp * 1e3 / r.nsPerOp);
+    }
+    std::printf("\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  Options opts;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      opts.filter = argv[++i];
+    } else if (std::strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+      opts.minTime = std::atof(argv[++i]);
+    } else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+      opts.repeat = std::max(1, std::atoi(argv[++i]));
+    } else if (std::strcmp(argv[i], "--json") == 0) {
+      opts.json = true;
+    } else {
+      std::fprintf(stderr,
+                   "Usage: %s [--filter substring] [--min-time seconds] "
+                   "[--repeat n] [--json]\n",
+                   argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<Result> results;
+  for (auto &b : benchmarks()) {
+    if (opts.filter && !std::strstr(b.name, opts.filter)) {
+      continue;
+    }
+    results.push_back(measure(b, opts));
+    if (!opts.json) {
+      std::fprintf(stderr, "%s done\n", b.name);
+    }
+  }
+  if (opts.json) {
+    printJSON(results, opts);
+  } else {
+    printTable(results);
+  }
+}
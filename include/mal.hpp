@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstddef>
 #include <string>
 
 struct MALState {
@@ -12,13 +13,49 @@ struct MALState {
   MALState(const MALState &s) = delete;
   MALState &operator=(const MALState &s) = delete;
 
+  // Reads a form into a register, to be compiled from there. The form is
+  // only kept until the next read_str, compile or load_file, and if it
+  // hasn't been compiled by then its register is set to nil.
   bool read_str(std::string &, int);
   bool compile(int);
   bool eval(int);
-  std::string print_str(int) const;
+  // Prints the value in a register. Printing readably quotes and escapes
+  // strings so that read_str reads them back.
+  std::string print_str(int, bool readably = true) const;
+  // Appends the printed value to out instead, so a caller printing many
+  // values can reuse one buffer.
+  void print_str(int, std::string &out, bool readably = true) const;
+
+  // Reads, compiles and runs every form in the file at path, which may also
+  // be an image written by compile_file.
+  bool load_file(const std::string &);
+  // Runs the file at path like load_file, and saves its compiled forms as an
+  // image, which load_file then runs without reading or compiling them.
+  bool compile_file(const std::string &path, const std::string &image);
+
+  // Saves the globals and everything they refer to, compiled functions
+  // included. Restoring the snapshot into a new state brings it to the same
+  // point without running any code; builtins are bound again by name.
+  bool save_snapshot(const std::string &path);
+  bool restore_snapshot(const std::string &path);
+
   std::string get_error() const;
   void clear_error();
 
+  // Maximum number of registers the VM may use. Deeper recursion fails with a
+  // stack overflow error.
+  void set_stack_limit(size_t);
+
+  // Constant folding and the peephole pass are on by default. Turning them off
+  // makes the bytecode map directly onto the source when debugging.
+  void set_optimize(bool);
+
+  // Samples the call stack hz times a second of CPU time until stop_profile,
+  // which writes the samples to path as folded stacks for flame graph tools.
+  // Only one state in a process can be profiled at a time.
+  bool start_profile(unsigned hz = 997);
+  bool stop_profile(const std::string &path);
+
 private:
   struct State;
   State *state;
@@ -27,12 +64,33 @@ private:
   static bool mult(MALState *, size_t);
   static bool sub(MALState *, size_t);
   static bool div(MALState *, size_t);
+  static bool lt(MALState *, size_t);
+  static bool le(MALState *, size_t);
+  static bool gt(MALState *, size_t);
+  static bool ge(MALState *, size_t);
+  static bool eq(MALState *, size_t);
   static bool list(MALState *, size_t);
   static bool is_list(MALState *, size_t);
   static bool vec(MALState *, size_t);
   static bool hash_map(MALState *, size_t);
   static bool is_empty(MALState *, size_t);
   static bool count(MALState *, size_t);
+  static bool nth(MALState *, size_t);
+  static bool conj(MALState *, size_t);
+  static bool cons(MALState *, size_t);
+  static bool first(MALState *, size_t);
+  static bool rest(MALState *, size_t);
+  static bool assoc(MALState *, size_t);
+  static bool dissoc(MALState *, size_t);
+  static bool get(MALState *, size_t);
+  static bool contains(MALState *, size_t);
+  static bool keys(MALState *, size_t);
+  static bool vals(MALState *, size_t);
+  static bool load(MALState *, size_t);
+  static bool read_file(MALState *, size_t);
+#ifdef MAL_INSTRUMENT
+  static bool vm_stats(MALState *, size_t);
+#endif
 };
 
 typedef bool (*CFunction)(MALState *state, size_t argCount);
@@ -0,0 +1,47 @@
+#include "arena.hpp"
+
+#include "heap.hpp"
+
+#include <algorithm>
+
+void *Arena::allocate(size_t size, size_t align) {
+  auto p = (char *)(((uintptr_t)cur + align - 1) & ~(uintptr_t)(align - 1));
+  if (cur && p + size <= end) {
+    cur = p + size;
+    return p;
+  }
+  auto n = std::max(BLOCK_SIZE, size + align);
+  blocks.push_back({std::make_unique<char[]>(n), n});
+  cur = blocks.back().data.get();
+  end = cur + n;
+  return allocate(size, align);
+}
+
+void Arena::reset() {
+  for (auto it = dtors.rbegin(); it != dtors.rend(); it++) {
+    it->second(it->first);
+  }
+  dtors.clear();
+  if (blocks.empty()) {
+    return;
+  }
+  blocks.resize(1);
+  cur = blocks[0].data.get();
+  end = cur + blocks[0].size;
+}
+
+MALType promote(Heap &heap, MALType m) {
+  if (m.as<MALList>() || m.as<MALVector>()) {
+    std::vector<MALType> items;
+    for (auto &e : visit(Iterator{}, m)) {
+      items.push_back(promote(heap, e));
+    }
+    auto begin = items.data();
+    auto end = begin + items.size();
+    if (m.as<MALList>()) {
+      return MALType{MALList::from(heap, begin, end)};
+    }
+    return MALType{MALVector::from(heap, begin, end)};
+  }
+  return m;
+}
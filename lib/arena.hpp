@@ -0,0 +1,56 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct Heap;
+
+// Bump allocator for the forms built by the reader. They are only needed until
+// the form has been compiled, so rather than going through the collector they
+// are all freed together by reset(). Arena objects must never be reachable
+// from the heap; quoted data is copied out with promote() first.
+struct Arena {
+  Arena() : cur(nullptr), end(nullptr){};
+  ~Arena() { reset(); };
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  template <typename T, typename... Args> T *alloc(Args &&...args) {
+    auto obj = new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+    if constexpr (!std::is_trivially_destructible_v<T>) {
+      dtors.push_back({obj, [](void *p) { static_cast<T *>(p)->~T(); }});
+    }
+    return obj;
+  }
+
+  // Destroys everything allocated so far. The first block is kept, so small
+  // reads don't allocate at all once the arena has warmed up.
+  void reset();
+
+private:
+  void *allocate(size_t size, size_t align);
+
+  static constexpr size_t BLOCK_SIZE = 16 * 1024;
+
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  std::vector<Block> blocks;
+  char *cur;
+  char *end;
+  std::vector<std::pair<void *, void (*)(void *)>> dtors;
+};
+
+// Copies a form that may live in an arena onto the heap. Atoms, symbols,
+// keywords and strings are already heap values and are returned as they are.
+MALType promote(Heap &heap, MALType m);
@@ -0,0 +1,162 @@
+#include "arith.hpp"
+
+#include "types.hpp"
+
+#include <cassert>
+
+static const char *illegalArguments(BinOp op) {
+  switch (op) {
+  case BinOp::Add:
+    return "Illegal arguments to add";
+  case BinOp::Sub:
+    return "Illegal arguments to sub";
+  case BinOp::Mul:
+    return "Illegal arguments to multiply";
+  case BinOp::Div:
+    return "Illegal arguments to divide";
+  case BinOp::Lt:
+  case BinOp::Le:
+  case BinOp::Gt:
+  case BinOp::Ge:
+    return "Illegal arguments to compare";
+  case BinOp::Eq:
+  case BinOp::None:
+    break;
+  }
+  assert(false);
+  return "";
+}
+
+static bool toDouble(MALType m, double &x) {
+  int64_t n;
+  if (toInt(m, n)) {
+    x = (double)n;
+    return true;
+  }
+  if (m.isDouble()) {
+    x = m.asDouble();
+    return true;
+  }
+  return false;
+}
+
+// Integer arithmetic where either side may be boxed.
+static const char *intBinop(Heap &heap, BinOp op, int64_t x, int64_t y,
+                            MALType &out) {
+  int64_t r = 0;
+  bool overflow = false;
+  switch (op) {
+  case BinOp::Add:
+    overflow = addOverflow(x, y, &r);
+    break;
+  case BinOp::Sub:
+    overflow = subOverflow(x, y, &r);
+    break;
+  case BinOp::Mul:
+    overflow = mulOverflow(x, y, &r);
+    break;
+  case BinOp::Div:
+    if (y == 0) {
+      return "Divide by zero";
+    }
+    overflow = x == std::numeric_limits<int64_t>::min() && y == -1;
+    r = overflow ? 0 : x / y;
+    break;
+  case BinOp::Lt:
+    out = MALType{x < y};
+    return nullptr;
+  case BinOp::Le:
+    out = MALType{x <= y};
+    return nullptr;
+  case BinOp::Gt:
+    out = MALType{x > y};
+    return nullptr;
+  case BinOp::Ge:
+    out = MALType{x >= y};
+    return nullptr;
+  case BinOp::Eq:
+  case BinOp::None:
+    assert(false);
+  }
+  if (overflow) {
+    return "Integer overflow";
+  }
+  out = makeInt(heap, r);
+  return nullptr;
+}
+
+const char *binopSlow(Heap &heap, BinOp op, MALType a, MALType b,
+                      MALType &out) {
+  if (op == BinOp::Eq) {
+    out = MALType{equals(a, b)};
+    return nullptr;
+  }
+
+  int64_t i, j;
+  if (toInt(a, i) && toInt(b, j)) {
+    return intBinop(heap, op, i, j, out);
+  }
+
+  double x, y;
+  if (!toDouble(a, x) || !toDouble(b, y)) {
+    return illegalArguments(op);
+  }
+  switch (op) {
+  case BinOp::Add:
+    out = MALType{x + y};
+    break;
+  case BinOp::Sub:
+    out = MALType{x - y};
+    break;
+  case BinOp::Mul:
+    out = MALType{x * y};
+    break;
+  case BinOp::Div:
+    out = MALType{x / y};
+    break;
+  case BinOp::Lt:
+    out = MALType{x < y};
+    break;
+  case BinOp::Le:
+    out = MALType{x <= y};
+    break;
+  case BinOp::Gt:
+    out = MALType{x > y};
+    break;
+  case BinOp::Ge:
+    out = MALType{x >= y};
+    break;
+  case BinOp::Eq:
+  case BinOp::None:
+    assert(false);
+  }
+  return nullptr;
+}
+
+const char *binopDynamic(Heap &heap, BinOp op, MALType a, MALType b,
+                         MALType &out) {
+  switch (op) {
+  case BinOp::Add:
+    return binop<BinOp::Add>(heap, a, b, out);
+  case BinOp::Sub:
+    return binop<BinOp::Sub>(heap, a, b, out);
+  case BinOp::Mul:
+    return binop<BinOp::Mul>(heap, a, b, out);
+  case BinOp::Div:
+    return binop<BinOp::Div>(heap, a, b, out);
+  case BinOp::Lt:
+    return binop<BinOp::Lt>(heap, a, b, out);
+  case BinOp::Le:
+    return binop<BinOp::Le>(heap, a, b, out);
+  case BinOp::Gt:
+    return binop<BinOp::Gt>(heap, a, b, out);
+  case BinOp::Ge:
+    return binop<BinOp::Ge>(heap, a, b, out);
+  case BinOp::Eq:
+    return binop<BinOp::Eq>(heap, a, b, out);
+  case BinOp::None:
+    break;
+  }
+  assert(false);
+  return "";
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include "heap.hpp"
+#include "types.hpp"
+
+#include <cstdint>
+#include <limits>
+
+// Arithmetic and comparison shared by the VM opcodes and the builtins. The
+// case of two inline integers is inlined; everything else, boxed integers
+// included, goes through binopSlow.
+//
+// Each function returns nullptr on success, or an error message.
+
+inline bool addOverflow(int64_t a, int64_t b, int64_t *r) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_add_overflow(a, b, r);
+#else
+  *r = (int64_t)((uint64_t)a + (uint64_t)b);
+  return (a < 0) == (b < 0) && (*r < 0) != (a < 0);
+#endif
+}
+
+inline bool subOverflow(int64_t a, int64_t b, int64_t *r) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_sub_overflow(a, b, r);
+#else
+  *r = (int64_t)((uint64_t)a - (uint64_t)b);
+  return (a < 0) != (b < 0) && (*r < 0) != (a < 0);
+#endif
+}
+
+inline bool mulOverflow(int64_t a, int64_t b, int64_t *r) {
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_mul_overflow(a, b, r);
+#else
+  *r = (int64_t)((uint64_t)a * (uint64_t)b);
+  if (a == 0 || b == 0) {
+    return false;
+  }
+  auto min = std::numeric_limits<int64_t>::min();
+  return (a == -1 && b == min) || (b == -1 && a == min) || *r / b != a;
+#endif
+}
+
+const char *binopSlow(Heap &heap, BinOp op, MALType a, MALType b,
+                      MALType &out);
+
+// Results that don't fit inline are boxed on heap.
+template <BinOp op>
+inline const char *binop(Heap &heap, MALType a, MALType b, MALType &out) {
+  if (a.isInt() && b.isInt()) {
+    // Inline integers are 48 bits, so only multiplication can overflow.
+    auto x = a.asInt();
+    auto y = b.asInt();
+    int64_t r;
+    switch (op) {
+    case BinOp::Add:
+      out = makeInt(heap, x + y);
+      return nullptr;
+    case BinOp::Sub:
+      out = makeInt(heap, x - y);
+      return nullptr;
+    case BinOp::Mul:
+      if (!mulOverflow(x, y, &r)) {
+        out = makeInt(heap, r);
+        return nullptr;
+      }
+      break;
+    case BinOp::Div:
+      if (y != 0) {
+        out = makeInt(heap, x / y);
+        return nullptr;
+      }
+      break;
+    case BinOp::Lt:
+      out = MALType{x < y};
+      return nullptr;
+    case BinOp::Le:
+      out = MALType{x <= y};
+      return nullptr;
+    case BinOp::Gt:
+      out = MALType{x > y};
+      return nullptr;
+    case BinOp::Ge:
+      out = MALType{x >= y};
+      return nullptr;
+    case BinOp::Eq:
+      out = MALType{x == y};
+      return nullptr;
+    case BinOp::None:
+      assert(false);
+    }
+  }
+  return binopSlow(heap, op, a, b, out);
+}
+
+// binop for an op that is only known at run time, as when folding constants.
+const char *binopDynamic(Heap &heap, BinOp op, MALType a, MALType b,
+                         MALType &out);
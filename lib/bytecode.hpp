@@ -5,14 +5,46 @@
 #include <cstdint>
 #include <limits>
 
+// CLOSURE creates a closure over the MALProto in K[D]. GET_UPVAL reads the
+// closure's upvalue D and CLOSE closes any upvalues on registers >= A.
+// TAILCALL is a CALL whose result is returned straight away, so it replaces the
+// current frame. Jumps add the signed D to the instruction pointer; JMPF only
+// jumps if R[A] is nil or false.
+//
+// Arithmetic and comparison opcodes compute R[A] = R[B] op R[C]. The K
+// variants take their right hand side from the constants: R[A] = R[B] op K[C].
 #define OPCODE_BUILDER(X, sep)                                                 \
   X(CONST, AD)                                                                 \
   sep X(GLOBAL_GET, AD)                                                        \
+  sep X(GLOBAL_GET_CHECK, AD)                                                  \
   sep X(GLOBAL_SET, AD)                                                        \
   sep X(NEW_LIST, AD)                                                          \
   sep X(CALL, AD)                                                              \
+  sep X(CLOSURE, AD)                                                           \
+  sep X(GET_UPVAL, AD)                                                         \
+  sep X(CLOSE, AD)                                                             \
+  sep X(TAILCALL, AD)                                                          \
+  sep X(JMP, AD)                                                               \
+  sep X(JMPF, AD)                                                              \
   sep X(PRIMITIVE, AD)                                                         \
-  sep X(MOV, AD) sep
+  sep X(MOV, AD)                                                               \
+  sep X(ADD, ABC)                                                              \
+  sep X(SUB, ABC)                                                              \
+  sep X(MUL, ABC)                                                              \
+  sep X(DIV, ABC)                                                              \
+  sep X(LT, ABC)                                                               \
+  sep X(LE, ABC)                                                               \
+  sep X(EQ, ABC)                                                               \
+  sep X(ADDK, ABC)                                                             \
+  sep X(SUBK, ABC)                                                             \
+  sep X(MULK, ABC)                                                             \
+  sep X(DIVK, ABC)                                                             \
+  sep X(LTK, ABC)                                                              \
+  sep X(LEK, ABC)                                                              \
+  sep X(GTK, ABC)                                                              \
+  sep X(GEK, ABC)                                                              \
+  sep X(EQK, ABC)                                                              \
+  sep X(RETURN, AD) sep
 
 #define COMMA ,
 #define BUILD_OPCODES(op, _) op
@@ -41,6 +73,12 @@ struct byteCode {
   inline uint16_t regD(void) const {
     return (uint16_t)((((uint16_t)bytes[3]) << 8) | ((uint16_t)bytes[2]));
   };
+  inline int16_t regSD(void) const { return (int16_t)regD(); };
+  inline void setOp(opCode op) { bytes[0] = (reg)op; };
+  inline void setD(uint16_t d) {
+    bytes[2] = (reg)(0xff & d);
+    bytes[3] = (reg)(d >> 8);
+  };
 
   alignas(uint32_t) reg bytes[4];
 };
@@ -2,31 +2,63 @@
 
 #include "types.hpp"
 
-#include <cassert>
+#include <algorithm>
 #include <cstdint>
+#include <iterator>
 #include <memory>
+#include <string>
 #include <vector>
 
+// Where a closure finds an upvalue when it is created: either a register of
+// the enclosing function or one of the enclosing closure's upvalues.
+struct UpvalDesc {
+  bool inStack;
+  reg index;
+};
+
+// The source line of the instructions from pc up to the next entry's pc.
+struct LineInfo {
+  uint32_t pc;
+  uint32_t line;
+};
+
+// The line a list or vector of a form starts on. The reader records one for
+// each in the order it finishes them, and the compiler sorts them by form to
+// look them up.
+struct SourceLine {
+  const MALObject *form;
+  uint32_t line;
+};
+typedef std::vector<SourceLine> SourceLines;
+
 struct Chunk {
   Chunk() = default;
   std::vector<byteCode> code;
   std::vector<MALType> constants;
+  uint16_t frameSize = 0; // Number of registers the code uses.
+  std::vector<UpvalDesc> upvalues;
+  reg numParams = 0;
+  bool variadic = false; // The last parameter collects any extra arguments.
 
-  uint16_t addConstant(MALType t) {
-    constants.push_back(t);
-    assert(constants.size() == (size_t)(uint16_t)constants.size());
-    return (uint16_t)constants.size() - 1;
+  // Where the code came from, for errors and profiles. name is set for
+  // functions bound by def! or let*, and file for code read from a file.
+  // Line 0 means unknown.
+  std::string name;
+  std::shared_ptr<const std::string> file;
+  uint32_t line = 0; // The line of the fn* or top level form.
+  std::vector<LineInfo> lines; // Sorted by pc, one entry per run of a line.
+
+  // Records that the instructions from pc on come from line.
+  void addLine(uint32_t pc, uint32_t line) {
+    if (lines.empty() || lines.back().line != line) {
+      lines.push_back({pc, line});
+    }
   };
 
-  uint16_t addConstant(std::string &str) {
-    constants.push_back(MALType{std::make_shared<MALString>(str)});
-    assert(constants.size() == (size_t)(uint16_t)constants.size());
-    return (uint16_t)constants.size() - 1;
-  }
-
-  uint16_t addKeyword(std::string &str) {
-    constants.push_back(MALType{std::make_shared<MALKeyword>(str)});
-    assert(constants.size() == (size_t)(uint16_t)constants.size());
-    return (uint16_t)constants.size() - 1;
-  }
+  uint32_t lineAt(size_t pc) const {
+    auto it = std::upper_bound(
+        lines.begin(), lines.end(), pc,
+        [](size_t pc, const LineInfo &info) { return pc < info.pc; });
+    return it == lines.begin() ? 0 : std::prev(it)->line;
+  };
 };
@@ -1,12 +1,21 @@
+#include "arena.hpp"
+#include "arith.hpp"
 #include "bytecode.hpp"
 #include "chunk.hpp"
+#include "globals.hpp"
+#include "heap.hpp"
+#include "optimizer.hpp"
 #include "state.hpp"
 #include "types.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <functional>
+#include <limits>
 #include <memory>
-#include <variant>
+#include <unordered_map>
+#include <utility>
 
 enum class ExpKind {
   NIL,         //
@@ -18,7 +27,9 @@ enum class ExpKind {
   KEYWORD,     // str is keyword name
   GLOBAL,      // str is symbol name
   LOCAL,       // s.aux is local register, s.info is vars index
+  UPVAL,       // s.info is upvalue index
   CALL,        // s.info is instruction index, s.aux is base register
+  VOID,        // the value has already been returned
   RELOCABLE,   // s.info is instruction index
   NONRELOCABLE // r is value register
 };
@@ -27,25 +38,28 @@ struct ExpDesc {
   ExpDesc() : kind(ExpKind::NIL){};
   ExpDesc(bool b) : kind(b ? ExpKind::TRUE : ExpKind::FALSE){};
   ExpDesc(double x) : kind(ExpKind::FLOAT) { u.x = x; };
-  ExpDesc(int n) : kind(ExpKind::INT) { u.n = n; };
+  ExpDesc(int64_t n) : kind(ExpKind::INT) { u.n = n; };
   ExpDesc(std::string str) : str(str), kind(ExpKind::STRING){};
 
   union {
-    int n;
+    int64_t n;
     double x;
     reg r;
     struct {
       uint32_t info;
       reg aux;
     } s;
-  } u;
+  } u = {};
   std::string str;
   ExpKind kind;
 };
 
 struct Scope {
   Scope *outer = nullptr;
-  size_t nVars; // Number of variables in outer scope.
+  size_t nVars;          // Number of variables in outer scope.
+  reg firstReg;          // First register used by this scope.
+  bool hasUpval = false; // Whether a closure captures one of its variables.
+  bool isFunction = false;
 };
 
 struct variableInfo {
@@ -55,21 +69,34 @@ struct variableInfo {
 };
 
 struct FuncState {
-  FuncState(std::vector<variableInfo> &vars)
-      : chunk(std::make_unique<Chunk>()), varsRef(vars), outer(nullptr){};
+  FuncState(std::vector<variableInfo> &vars, Heap &heap, Globals &globals,
+            bool optimize, uint32_t &line, std::shared_ptr<MALError> &error,
+            std::shared_ptr<const std::string> file)
+      : chunk(std::make_unique<Chunk>()), optimize(optimize), line(line),
+        error(error), varsRef(vars), heap(heap), globals(globals),
+        outer(nullptr) {
+    chunk->file = std::move(file);
+  };
   FuncState(FuncState &outer)
-      : chunk(std::make_unique<Chunk>()), varsRef(outer.varsRef),
-        outer(&outer){};
+      : chunk(std::make_unique<Chunk>()), optimize(outer.optimize),
+        line(outer.line), error(outer.error), definedAs(outer.definedAs),
+        varsRef(outer.varsRef), heap(outer.heap), globals(outer.globals),
+        outer(&outer) {
+    chunk->file = outer.chunk->file;
+  };
 
+  // Reserves n more registers and returns the last of them. A function that
+  // needs more registers than an instruction can name fails to compile; the
+  // register returned then is only a stand in until the error is seen.
   reg regReserve(reg n) {
     size_t sz = nextFreeReg + n;
-    if (sz > frameSize) {
-      if (sz > MAX_REG) {
-        // TODO How to handle this error?
-        assert(false);
+    if (sz > MAX_REG) {
+      if (!error) {
+        error = std::make_shared<MALError>("Too many registers");
       }
-      frameSize = static_cast<reg>(sz);
+      return nextFreeReg == 0 ? 0 : nextFreeReg - 1;
     }
+    frameSize = std::max(frameSize, (uint16_t)sz);
     nextFreeReg = static_cast<reg>(sz);
     return nextFreeReg - 1;
   };
@@ -101,30 +128,80 @@ struct FuncState {
     return e.u.r;
   }
 
-  int varLookup(std::string &name, ExpDesc &e, bool) {
+  // base is false when the lookup comes from a nested function, in which case
+  // a local found here is captured as an upvalue.
+  void varLookup(std::string &name, ExpDesc &e, bool base) {
     auto r = varLookupLocal(name);
     if (r >= 0) {
-      e.u.s.aux = (reg)r;
+      e.u.s.info = varMap[(size_t)r];
+      e.u.s.aux = varsRef[e.u.s.info].slot;
       e.kind = ExpKind::LOCAL;
-      // TODO upvalue logic
-      e.u.s.info = varMap[(reg)r];
-      return (int)e.u.s.info;
+      if (!base) {
+        markUpval(r);
+      }
+      return;
     }
     if (outer) {
-      auto vidx = outer->varLookup(name, e, false);
-      if (vidx >= 0) {
-        // TODO it's an upvalue
+      auto idx = upvalLookup(name);
+      if (idx < 0) {
+        outer->varLookup(name, e, false);
+        if (e.kind != ExpKind::LOCAL && e.kind != ExpKind::UPVAL) {
+          return;
+        }
+        idx = newUpval(name, e);
       }
-      return vidx;
+      e.u.s.info = (uint32_t)idx;
+      e.kind = ExpKind::UPVAL;
+      return;
     }
 
     // Must be a global variable.
     e = ExpDesc(name);
     e.kind = ExpKind::GLOBAL;
-    return -1;
   };
 
+  // Returns the value of e from the function. A call in this position
+  // becomes a TAILCALL, which returns by itself.
+  void ret(ExpDesc &e) {
+    if (e.kind == ExpKind::VOID) {
+      return;
+    }
+    if (e.kind == ExpKind::CALL) {
+      chunk->code[e.u.s.info].setOp(opCode::TAILCALL);
+    } else {
+      emit_ins(byteCode::AD(opCode::RETURN, expr2anyReg(e), 0));
+    }
+    e.kind = ExpKind::VOID;
+  }
+
+  // Emits a jump that is taken when cond is falsy, to be patched later.
+  uint32_t jumpIfFalse(ExpDesc &cond) {
+    auto r = expr2anyReg(cond);
+    exprFree(cond);
+    return emit_ins(byteCode::AD(opCode::JMPF, r, 0));
+  }
+
+  // Points the jump at index jmp to the next instruction emitted. Jumps only
+  // go forwards, and no further than the offset can say.
+  void patchJump(uint32_t jmp) {
+    auto offset = (ptrdiff_t)chunk->code.size() - (ptrdiff_t)jmp - 1;
+    assert(offset >= 0);
+    if (offset > INT16_MAX) {
+      if (!error) {
+        error = std::make_shared<MALError>("Jump too long");
+      }
+      return;
+    }
+    chunk->code[jmp].setD((uint16_t)offset);
+  }
+
+  inline reg nextReg() const { return nextFreeReg; }
+
   std::unique_ptr<Chunk> getChunk() {
+    chunk->frameSize = frameSize;
+    if (optimize) {
+      optimizeChunk(*chunk);
+    }
     auto ret = std::move(chunk);
     chunk = nullptr;
     return ret;
@@ -132,22 +209,112 @@ struct FuncState {
 
   uint32_t emit_ins(byteCode ins) {
     // TODO handle jumps
+    chunk->addLine((uint32_t)chunk->code.size(), line);
     chunk->code.push_back(ins);
     return (uint32_t)chunk->code.size() - 1;
   }
 
   void emitGlobalStore(std::string &var, ExpDesc &e) {
     auto r = expr2anyReg(e);
-    auto str = chunk->addConstant(MALType{std::make_shared<MALString>(var)});
-    auto ins = byteCode::AD(opCode::GLOBAL_SET, r, str);
+    auto ins = byteCode::AD(opCode::GLOBAL_SET, r, globalSlot(var));
     emit_ins(ins);
   }
 
+  // Returns the index of t in the constants, adding it if needed. Equal
+  // numbers, and interned objects, share an entry. Running out of indexes
+  // fails the compile; index 0 is only a stand in until the error is seen.
+  uint16_t addConstant(MALType t) {
+    auto next = chunk->constants.size();
+    // Each boxed integer is a separate object, so those go by value.
+    auto n = t.as<MALInt>();
+    auto [it, inserted] =
+        n ? boxedIntIndex.try_emplace((uint64_t)n->value, (uint16_t)next)
+          : constantIndex.try_emplace(t.bits, (uint16_t)next);
+    if (inserted) {
+      if (next > std::numeric_limits<uint16_t>::max()) {
+        if (!error) {
+          error = std::make_shared<MALError>("Too many constants");
+        }
+        return 0;
+      }
+      chunk->constants.push_back(t);
+    }
+    return it->second;
+  }
+
+  // The slot of a global. Running out of slots fails the compile; slot 0 is
+  // only a stand in until the error is seen.
+  uint16_t globalSlot(const std::string &name) {
+    if (!globals.hasRoom(name)) {
+      if (!error) {
+        error = std::make_shared<MALError>("Too many globals");
+      }
+      return 0;
+    }
+    return globals.slot(name);
+  }
+
+  // The dedicated opcode for the builtin currently bound to a global, if any.
+  BinOp globalBinop(const std::string &name) {
+    auto f = globals.values[globalSlot(name)].as<MALCFunc>();
+    return f ? f->binop : BinOp::None;
+  }
+
+  // lhs should already be in a register unless it is a numeral. The result is
+  // left in lhs as a RELOCABLE expression.
+  void emitBinop(BinOp op, ExpDesc &lhs, ExpDesc &rhs) {
+    if (optimize && isNumeral(lhs) && isNumeral(rhs) &&
+        foldBinop(op, lhs, rhs)) {
+      return;
+    }
+    // Keep constants on the right so that the K variants can be used.
+    if (isNumeral(lhs) && !isNumeral(rhs)) {
+      auto swapped = swapOperands(op);
+      if (swapped != BinOp::None) {
+        std::swap(lhs, rhs);
+        op = swapped;
+      }
+    }
+    auto b = expr2anyReg(lhs);
+
+    byteCode ins;
+    // The constant may already be in the pool at an index that fits in C.
+    uint16_t k = isNumeral(rhs) ? addConstant(numeral(rhs)) : 0;
+    if (isNumeral(rhs) && k <= MAX_REG) {
+      exprFree(lhs);
+      ins = byteCode::ABC(constOpcode(op), 0, b, (reg)k);
+    } else {
+      auto c = expr2anyReg(rhs);
+      if (b > c) {
+        exprFree(lhs);
+        exprFree(rhs);
+      } else {
+        exprFree(rhs);
+        exprFree(lhs);
+      }
+      if (op == BinOp::Gt || op == BinOp::Ge) {
+        std::swap(b, c);
+        op = swapOperands(op);
+      }
+      ins = byteCode::ABC(regOpcode(op), 0, b, c);
+    }
+    lhs.u.s.info = emit_ins(ins);
+    lhs.kind = ExpKind::RELOCABLE;
+  }
+
   void beginScope(Scope &scope) {
     scope.nVars = nVars;
+    scope.firstReg = nextFreeReg;
     scope.outer = this->scope;
     this->scope = &scope;
-    assert(nextFreeReg == nVars);
+  }
+
+  // Declares a new local living in register r.
+  void addLocal(const std::string &name, reg r) {
+    assert(varMap.size() == nVars);
+    varMap.push_back((uint16_t)varsRef.size());
+    varsRef.push_back({name, r, 0});
+    nVars++;
   }
 
   void endScope() {
@@ -155,18 +322,205 @@ struct FuncState {
     scope = block->outer;
     while (nVars > block->nVars) {
       varsRef.pop_back();
+      varMap.pop_back();
       nVars--;
     }
-    nextFreeReg = nVars;
-    // TODO upvalues
+    nextFreeReg = block->firstReg;
+    // Leaving a function closes everything in RETURN.
+    if (block->hasUpval && !block->isFunction) {
+      emit_ins(byteCode::AD(opCode::CLOSE, block->firstReg, 0));
+    }
+  }
+
+  // Moves the value of a scope's body out of the registers the scope used, so
+  // that it survives the scope ending.
+  void exprToScope(ExpDesc &e, const Scope &sc) {
+    switch (e.kind) {
+    case ExpKind::LOCAL:
+      if (e.u.s.aux < sc.firstReg) {
+        return;
+      }
+      break;
+    case ExpKind::CALL:
+    case ExpKind::NONRELOCABLE:
+      break;
+    default:
+      return;
+    }
+    regReserve(1);
+    expr2Reg(e, sc.firstReg);
   }
 
   reg nVars = 0;
   std::vector<uint16_t> varMap;
+  std::unique_ptr<Chunk> chunk;
+  bool optimize; // Fold constants and run the peephole pass.
+  uint32_t &line; // The source line of the form being compiled.
+  std::shared_ptr<MALError> &error; // The compiler's.
+  // The global def! binds this function, or one it is nested in, to. That is
+  // set before any of their code can run.
+  std::string definedAs;
+
+  static inline bool isNumeral(const ExpDesc &e) {
+    return e.kind == ExpKind::INT || e.kind == ExpKind::FLOAT;
+  }
+
+  // Whether e is known at compile time, and so is its truthiness.
+  static inline bool isConstant(const ExpDesc &e) {
+    switch (e.kind) {
+    case ExpKind::NIL:
+    case ExpKind::TRUE:
+    case ExpKind::FALSE:
+    case ExpKind::FLOAT:
+    case ExpKind::INT:
+    case ExpKind::STRING:
+    case ExpKind::KEYWORD:
+      return true;
+    default:
+      return false;
+    }
+  }
 
 private:
+  // The op that gives the same result with its operands swapped.
+  static BinOp swapOperands(BinOp op) {
+    switch (op) {
+    case BinOp::Add:
+    case BinOp::Mul:
+    case BinOp::Eq:
+      return op;
+    case BinOp::Lt:
+      return BinOp::Gt;
+    case BinOp::Gt:
+      return BinOp::Lt;
+    case BinOp::Le:
+      return BinOp::Ge;
+    case BinOp::Ge:
+      return BinOp::Le;
+    case BinOp::Sub:
+    case BinOp::Div:
+    case BinOp::None:
+      break;
+    }
+    return BinOp::None;
+  }
+
+  static opCode regOpcode(BinOp op) {
+    switch (op) {
+    case BinOp::Add:
+      return opCode::ADD;
+    case BinOp::Sub:
+      return opCode::SUB;
+    case BinOp::Mul:
+      return opCode::MUL;
+    case BinOp::Div:
+      return opCode::DIV;
+    case BinOp::Lt:
+      return opCode::LT;
+    case BinOp::Le:
+      return opCode::LE;
+    case BinOp::Eq:
+      return opCode::EQ;
+    case BinOp::Gt:
+    case BinOp::Ge:
+    case BinOp::None:
+      break;
+    }
+    assert(false);
+    return opCode::CALL;
+  }
+
+  static opCode constOpcode(BinOp op) {
+    switch (op) {
+    case BinOp::Add:
+      return opCode::ADDK;
+    case BinOp::Sub:
+      return opCode::SUBK;
+    case BinOp::Mul:
+      return opCode::MULK;
+    case BinOp::Div:
+      return opCode::DIVK;
+    case BinOp::Lt:
+      return opCode::LTK;
+    case BinOp::Le:
+      return opCode::LEK;
+    case BinOp::Gt:
+      return opCode::GTK;
+    case BinOp::Ge:
+      return opCode::GEK;
+    case BinOp::Eq:
+      return opCode::EQK;
+    case BinOp::None:
+      break;
+    }
+    assert(false);
+    return opCode::CALL;
+  }
+
+  inline MALType numeral(const ExpDesc &e) {
+    return e.kind == ExpKind::INT ? makeInt(heap, e.u.n) : MALType{e.u.x};
+  }
+
+  // Evaluates op at compile time, leaving the result in lhs. Operations that
+  // would fail are left for the VM to report.
+  bool foldBinop(BinOp op, ExpDesc &lhs, const ExpDesc &rhs) {
+    MALType out;
+    int64_t n;
+    if (binopDynamic(heap, op, numeral(lhs), numeral(rhs), out)) {
+      return false;
+    }
+    if (toInt(out, n)) {
+      lhs = ExpDesc(n);
+    } else if (out.isDouble()) {
+      lhs = ExpDesc(out.asDouble());
+    } else {
+      assert(out.isBool());
+      lhs = ExpDesc(out.asBool());
+    }
+    return true;
+  }
+
+  // Registers below this hold locals.
+  reg varStackLevel() const {
+    return nVars == 0 ? 0 : (reg)(varsRef[varMap[nVars - 1]].slot + 1);
+  }
+
+  // Marks the scope declaring local number level as captured, so that it
+  // closes its upvalues when it ends.
+  void markUpval(int level) {
+    auto block = scope;
+    while (block && block->nVars > (size_t)level) {
+      block = block->outer;
+    }
+    if (block) {
+      block->hasUpval = true;
+    }
+  }
+
+  int upvalLookup(const std::string &name) {
+    for (size_t i = 0; i < upvalNames.size(); i++) {
+      if (upvalNames[i] == name) {
+        return (int)i;
+      }
+    }
+    return -1;
+  }
+
+  // e is how the enclosing function sees the variable.
+  int newUpval(const std::string &name, const ExpDesc &e) {
+    if (e.kind == ExpKind::LOCAL) {
+      chunk->upvalues.push_back({true, e.u.s.aux});
+    } else {
+      assert(e.kind == ExpKind::UPVAL);
+      chunk->upvalues.push_back({false, (reg)e.u.s.info});
+    }
+    assert(chunk->upvalues.size() <= MAX_REG);
+    upvalNames.push_back(name);
+    return (int)upvalNames.size() - 1;
+  }
+
   void regFree(reg r) {
-    if (r >= nVars) {
+    if (r >= varStackLevel()) {
       nextFreeReg--;
       assert(r == nextFreeReg);
     }
@@ -175,9 +529,13 @@ private:
   void exprDischarge(ExpDesc &e) {
     switch (e.kind) {
     case ExpKind::GLOBAL: {
-      auto str =
-          chunk->addConstant(MALType{std::make_shared<MALString>(e.str)});
-      auto ins = byteCode::AD(opCode::GLOBAL_GET, 0, str);
+      // Globals can't be undefined once set, so only slots that are still
+      // empty at compile time need to be checked when they are loaded.
+      auto slot = globalSlot(e.str);
+      auto op = globals.isDefined(slot) || e.str == definedAs
+                    ? opCode::GLOBAL_GET
+                    : opCode::GLOBAL_GET_CHECK;
+      auto ins = byteCode::AD(op, 0, slot);
       e.u.s.info = emit_ins(ins);
       e.kind = ExpKind::RELOCABLE;
       break;
@@ -186,6 +544,11 @@ private:
       e.kind = ExpKind::NONRELOCABLE;
       e.u.r = e.u.s.aux;
       break;
+    case ExpKind::UPVAL:
+      e.u.s.info = emit_ins(
+          byteCode::AD(opCode::GET_UPVAL, 0, (uint16_t)e.u.s.info));
+      e.kind = ExpKind::RELOCABLE;
+      break;
     case ExpKind::CALL:
       e.kind = ExpKind::NONRELOCABLE;
       e.u.r = e.u.s.aux;
@@ -200,6 +563,8 @@ private:
     case ExpKind::RELOCABLE:
     case ExpKind::NONRELOCABLE:
       return;
+    case ExpKind::VOID:
+      assert(false);
     }
   };
 
@@ -215,21 +580,29 @@ private:
     case ExpKind::NIL:
       emit_ins(byteCode::AD(opCode::PRIMITIVE, r, KNIL));
       break;
+    case ExpKind::TRUE:
+      emit_ins(byteCode::AD(opCode::PRIMITIVE, r, KTRUE));
+      break;
+    case ExpKind::FALSE:
+      emit_ins(byteCode::AD(opCode::PRIMITIVE, r, KFALSE));
+      break;
     case ExpKind::INT: {
-      emit_ins(
-          byteCode::AD(opCode::CONST, r, chunk->addConstant(MALType{e.u.n})));
+      emit_ins(byteCode::AD(opCode::CONST, r,
+                            addConstant(makeInt(heap, e.u.n))));
       break;
     }
     case ExpKind::FLOAT: {
       emit_ins(
-          byteCode::AD(opCode::CONST, r, chunk->addConstant(MALType{e.u.x})));
+          byteCode::AD(opCode::CONST, r, addConstant(MALType{e.u.x})));
       break;
     }
     case ExpKind::STRING:
-      emit_ins(byteCode::AD(opCode::CONST, r, chunk->addConstant(e.str)));
+      emit_ins(byteCode::AD(opCode::CONST, r,
+                            addConstant(heap.internString(e.str))));
       break;
     case ExpKind::KEYWORD:
-      emit_ins(byteCode::AD(opCode::CONST, r, chunk->addKeyword(e.str)));
+      emit_ins(byteCode::AD(opCode::CONST, r,
+                            addConstant(heap.internKeyword(e.str))));
       break;
     case ExpKind::RELOCABLE:
       chunk->code[e.u.s.info].regA() = r;
@@ -249,7 +622,7 @@ private:
   }
 
   int varLookupLocal(std::string &str) {
-    for (int i = (int)varsRef.size() - 1; i >= 0; i--) {
+    for (int i = (int)nVars - 1; i >= 0; i--) {
       if (varsRef[varMap[(size_t)i]].name == str) {
         return i;
       }
@@ -258,42 +631,108 @@ private:
   }
 
   reg nextFreeReg = 0;
-  uint8_t frameSize = 0;
-  std::unique_ptr<Chunk> chunk;
+  uint16_t frameSize = 0;
   std::vector<variableInfo> &varsRef;
+  Heap &heap;
+  Globals &globals;
   Scope *scope = nullptr;
   FuncState *outer;
+  std::vector<std::string> upvalNames;
+  // Where each constant is, so that equal ones share an entry.
+  std::unordered_map<uint64_t, uint16_t> constantIndex;
+  std::unordered_map<uint64_t, uint16_t> boxedIntIndex;
 };
 
 struct Compiler {
-  Compiler(ExpDesc &e)
-      : vars(), fn(new FuncState(vars)), e(&e), error(nullptr){};
+  Compiler(ExpDesc &e, Heap &heap, Globals &globals, bool optimize,
+           const SourceLines &lines, std::shared_ptr<const std::string> file)
+      : vars(), line(0), error(nullptr),
+        fn(new FuncState(vars, heap, globals, optimize, line, error,
+                         std::move(file))),
+        e(&e), heap(heap), lines(lines){};
   Compiler(const Compiler &) = delete;
   Compiler &operator=(const Compiler &) = delete;
   ~Compiler() { delete fn; }
 
   std::vector<variableInfo> vars;
+  // The line of the innermost list being compiled. It is left at the form
+  // that failed when there is an error.
+  uint32_t line;
+  std::shared_ptr<MALError> error;
   FuncState *fn;
   ExpDesc *e;
-  std::shared_ptr<MALError> error;
+  Heap &heap;
+  const SourceLines &lines;
+  // Whether the form being compiled is the last thing its function does.
+  bool tail = false;
+  // The name the next fn* is bound to.
+  std::string fnName;
+  // The global the next fn* is bound to, if def! binds it.
+  std::string fnGlobal;
 
   void operator()(std::monostate) { *e = ExpDesc(); };
   void operator()(bool b) { *e = ExpDesc(b); };
-  void operator()(int n) { *e = ExpDesc(n); };
+  void operator()(int64_t n) { *e = ExpDesc(n); };
+  void operator()(MALInt *n) { *e = ExpDesc(n->value); };
   void operator()(double x) { *e = ExpDesc(x); };
-  void operator()(const std::shared_ptr<MALSymbol> &sym) {
+  void operator()(MALSymbol *sym) {
     fn->varLookup(sym->symbol, *e, true);
   };
-  void operator()(const std::shared_ptr<MALKeyword> &key) {
+  void operator()(MALKeyword *key) {
     *e = ExpDesc(key->keyword);
     e->kind = ExpKind::KEYWORD;
   };
-  void operator()(std::shared_ptr<MALString> str) { *e = ExpDesc(str->str); };
-  void operator()(std::shared_ptr<MALCFunc>) { assert(false); };
-  void operator()(std::shared_ptr<CallFrame>) { assert(false); };
-  void operator()(std::shared_ptr<MALMap>) { assert(false); };
+  void operator()(MALString *str) { *e = ExpDesc(str->str); };
+  void operator()(MALCFunc *) { assert(false); };
+  void operator()(MALMap *) { assert(false); };
+  void operator()(MALVecNode *) { assert(false); };
+  void operator()(MALMapNode *) { assert(false); };
+  void operator()(MALProto *) { assert(false); };
+  void operator()(MALClosure *) { assert(false); };
+  void operator()(MALUpvalue *) { assert(false); };
+
+  void operator()(MALList *l) {
+    auto outer = enterForm(l);
+    list(l);
+    leaveForm(outer);
+  };
 
-  void operator()(const std::shared_ptr<MALList> &l) {
+  void operator()(MALVector *v) {
+    auto outer = enterForm(v);
+    tail = false;
+    if (isLiteral(MALType{v})) {
+      // The form lives in the reader's arena, so the constant is a heap copy.
+      auto k = fn->addConstant(promote(heap, MALType{v}));
+      e->u.s.info = fn->emit_ins(byteCode::AD(opCode::CONST, 0, k));
+      e->kind = ExpKind::RELOCABLE;
+    } else {
+      literalCall("vec", "conj", v->begin(), v->end());
+    }
+    leaveForm(outer);
+  };
+
+private:
+  // Moves to the line a list or vector was read from, if it is known.
+  // Returns the line to go back to once it has been compiled.
+  uint32_t enterForm(const MALObject *form) {
+    auto outer = line;
+    auto it = std::lower_bound(lines.begin(), lines.end(), form, byForm);
+    if (it != lines.end() && it->form == form) {
+      line = it->line;
+    }
+    if (!fn->chunk->line) {
+      fn->chunk->line = line;
+    }
+    return outer;
+  }
+  void leaveForm(uint32_t outer) {
+    if (!error) {
+      line = outer;
+    }
+  }
+
+  void list(MALList *l) {
+    bool isTail = std::exchange(tail, false);
     if (l->empty()) {
       auto r = fn->regReserve(1);
       fn->emit_ins(byteCode::AD(opCode::NEW_LIST, r, 0));
@@ -303,52 +742,171 @@ struct Compiler {
     };
 
     // Special forms
-    if (auto m = std::get_if<std::shared_ptr<MALSymbol>>(&l->data[0].data); m) {
-      auto &form = (*m)->symbol;
+    if (auto m = l->first.as<MALSymbol>(); m) {
+      auto &form = m->symbol;
       if (form == "def!") {
         defCall(*l);
         return;
       } else if (form == "let*") {
-        letCall(*l);
+        letCall(*l, isTail);
+        return;
+      } else if (form == "fn*") {
+        fnCall(*l);
+        return;
+      } else if (form == "do") {
+        body(++l->begin(), l->end(), isTail);
+        return;
+      } else if (form == "if") {
+        ifCall(*l, isTail);
+        return;
+      } else if (form == "quote") {
+        quoteCall(*l);
+        return;
+      }
+    }
+
+    if (l->size() == 3) {
+      if (auto op = builtinBinop(l->first); op != BinOp::None) {
+        binopCall(op, l->rest->first, l->rest->rest->first);
+        return;
+      }
+    }
+
+    // The reader turns map literals into calls to hash-map, which can be as
+    // large as vectors.
+    if (auto m = l->first.as<MALSymbol>(); m && m->symbol == "hash-map") {
+      ExpDesc h;
+      fn->varLookup(m->symbol, h, true);
+      if (h.kind == ExpKind::GLOBAL) {
+        literalCall("hash-map", "assoc", ++l->begin(), l->end());
         return;
       }
     }
 
     // a non-empty list is a function call.
-    functionCall(*l);
-  };
+    functionCall(l->first, ++l->begin(), l->end());
+  }
 
-  void operator()(const std::shared_ptr<MALVector> &v) {
-    auto l = MALList(v->size() + 1);
-    l.data.push_back(MALType{std::make_shared<MALSymbol>("vec")});
-    for (auto &m : *v) {
-      l.data.push_back(m);
+  // Whether m evaluates to itself, so that it can be a constant.
+  static bool isLiteral(const MALType &m) {
+    if (auto v = m.as<MALVector>()) {
+      for (auto &x : *v) {
+        if (!isLiteral(x)) {
+          return false;
+        }
+      }
+      return true;
     }
-    functionCall(l);
-  };
+    return !m.as<MALList>() && !m.as<MALSymbol>();
+  }
 
-private:
-  void functionCall(const MALList &l) {
-    assert(!l.empty());
-    auto it = l.begin();
-    std::visit(*this, it->data);
+  // Elements of a collection literal passed to a single call. Larger
+  // literals are built a chunk at a time, so that they don't need a register
+  // for every element. An even number keeps map keys with their values.
+  static constexpr size_t LITERAL_CHUNK = 64;
+
+  // Builds a collection literal by calling make with the first chunk of its
+  // elements, then add with the collection so far and each later chunk.
+  void literalCall(const char *make, const char *add, SeqIterator it,
+                   SeqIterator end) {
+    auto next = chunkEnd(it, end);
+    functionCall(MALType{heap.intern(make)}, it, next);
+    if (error) {
+      return;
+    }
+    auto base = e->u.s.aux;
+    while (next != end) {
+      ExpDesc acc;
+      acc.kind = ExpKind::NONRELOCABLE;
+      acc.u.r = base;
+      it = next;
+      next = chunkEnd(it, end);
+      functionCall(MALType{heap.intern(add)}, it, next, &acc);
+      if (error) {
+        return;
+      }
+      fn->expr2Reg(*e, base);
+      fn->setNextReg(base + 1);
+    }
+  }
+
+  static SeqIterator chunkEnd(SeqIterator it, SeqIterator end) {
+    for (size_t i = 0; i < LITERAL_CHUNK && it != end; i++) {
+      it++;
+    }
+    return it;
+  }
+
+  static bool byForm(const SourceLine &a, const MALObject *form) {
+    return std::less<const MALObject *>()(a.form, form);
+  }
+
+  // Whether m is a fn* form, which can take its name from a binding.
+  static bool isFnForm(const MALType &m) {
+    auto l = m.as<MALList>();
+    auto head = l && !l->empty() ? l->first.as<MALSymbol>() : nullptr;
+    return head && head->symbol == "fn*";
+  }
+  BinOp builtinBinop(const MALType &head) {
+    auto sym = head.as<MALSymbol>();
+    if (!sym) {
+      return BinOp::None;
+    }
+    ExpDesc h;
+    fn->varLookup(sym->symbol, h, true);
+    if (h.kind != ExpKind::GLOBAL) {
+      return BinOp::None;
+    }
+    return fn->globalBinop(h.str);
+  }
+
+  void binopCall(BinOp op, const MALType &lhs, const MALType &rhs) {
+    ExpDesc *e_cache = e;
+    ExpDesc e1;
+    ExpDesc e2;
+    e = &e1;
+    visit(*this, lhs);
+    if (!error && !FuncState::isNumeral(e1)) {
+      fn->expr2anyReg(e1);
+    }
+    e = &e2;
+    if (!error) {
+      visit(*this, rhs);
+    }
+    e = e_cache;
+    if (error)
+      return;
+    fn->emitBinop(op, e1, e2);
+    *e = e1;
+  }
+
+  // Compiles a call of head with the arguments in [it, end).
+  // Calls head with the forms in [it, end) as arguments, after first if it
+  // is given.
+  void functionCall(const MALType &head, SeqIterator it, SeqIterator end,
+                    const ExpDesc *first = nullptr) {
+    visit(*this, head);
     if (error)
       return;
     fn->expr2nextReg(*e);
 
     uint16_t argCount = 0;
-    it++;
-    if (it != l.end()) {
+    if (first) {
+      ExpDesc arg = *first;
+      fn->expr2Reg(arg, fn->regReserve(1));
+      argCount++;
+    }
+    if (it != end) {
       ExpDesc *e_cache = e;
       ExpDesc args;
       e = &args;
-      std::visit(*this, it->data);
+      visit(*this, *it);
       if (error)
         return;
       argCount++;
-      for (it++; it != l.end(); it++) {
+      for (it++; it != end; it++) {
         fn->expr2nextReg(*e);
-        std::visit(*this, it->data);
+        visit(*this, *it);
         if (error)
           return;
         argCount++;
@@ -381,20 +939,22 @@ private:
     }
     assert(l.size() == 3);
     auto it = ++l.begin();
-    auto sym = std::get_if<std::shared_ptr<MALSymbol>>(&it->data);
+    auto sym = it->as<MALSymbol>();
     if (sym == nullptr) {
       error = std::make_shared<MALError>("Var name should be a simple symbol.");
       return;
     }
     it++;
 
-    std::visit(*this, it->data);
-    fn->emitGlobalStore((*sym)->symbol, *e);
+    if (isFnForm(*it)) {
+      fnName = sym->symbol;
+      fnGlobal = sym->symbol;
+    }
+    visit(*this, *it);
+    fn->emitGlobalStore(sym->symbol, *e);
   }
 
-  void letCall(const MALList &l) {
-    Scope sc;
-    fn->beginScope(sc);
+  void letCall(const MALList &l, bool isTail) {
     auto it = l.begin();
     assert(it != l.end());
     it++;
@@ -403,72 +963,272 @@ private:
       return;
     }
 
+    Scope sc;
+    fn->beginScope(sc);
+
     // This is where we actually handle the assignments.
-    auto [ptr, end] = std::visit(Iterator{*it}, it->data);
-    if (ptr == nullptr) {
+    auto bindings = visit(Iterator{}, *it);
+    if (!bindings.valid) {
       error = std::make_shared<MALError>("argument to let* isn't a sequence");
       return;
     }
+    auto ptr = bindings.begin();
+    auto end = bindings.end();
     while (ptr != end) {
-      auto s = std::get_if<std::shared_ptr<MALSymbol>>(&ptr->data);
+      auto s = ptr->as<MALSymbol>();
       if (!s) {
         error = std::make_shared<MALError>("Unsupported let binding");
         return;
       }
-      // If we cared about stack space we, would check if this was shadowing a
-      // variable in the same scope. since we look for variables from newest
-      // defined to oldest, this shouldn't matter.
-      assert(fn->varMap.size() == fn->nVars);
-      fn->varMap.push_back((uint16_t)vars.size());
-      vars.push_back({(*s)->symbol, 0, 0});
 
       ptr++;
       if (ptr != end) {
-        std::visit(*this, ptr->data);
+        if (isFnForm(*ptr)) {
+          fnName = s->symbol;
+        }
+        visit(*this, *ptr);
+        if (error)
+          return;
       } else {
         e->kind = ExpKind::NIL;
       }
       fn->expr2nextReg(*e);
-      auto &v = *vars.rbegin();
-      v.slot = fn->nVars;
-      fn->nVars++;
-      ptr++;
+      if (error)
+        return;
+      // If we cared about stack space we, would check if this was shadowing a
+      // variable in the same scope. since we look for variables from newest
+      // defined to oldest, this shouldn't matter.
+      fn->addLocal(s->symbol, e->u.r);
+      if (ptr != end) {
+        ptr++;
+      }
     }
 
     it++;
-    if (it != l.end()) {
-      std::visit(*this, it->data);
+    body(it, l.end(), isTail);
+    if (error)
+      return;
 
-      for (it++; it != l.end(); it++) {
-        fn->expr2nextReg(*e);
-        std::visit(*this, it->data);
+    if (isTail) {
+      // Return while the scope's registers are still live.
+      fn->ret(*e);
+    } else if (sc.hasUpval) {
+      // The result must be computed before CLOSE reads the captured registers.
+      fn->expr2nextReg(*e);
+    }
+    fn->endScope();
+    fn->exprToScope(*e, sc);
+  }
+
+  // Compiles m, telling list forms whether they are in tail position.
+  void visitTail(const MALType &m, bool isTail) {
+    tail = isTail;
+    visit(*this, m);
+    tail = false;
+  }
+
+  // Compiles a sequence of forms, leaving the value of the last one in e.
+  void body(SeqIterator it, SeqIterator end, bool isTail) {
+    if (it == end) {
+      *e = ExpDesc();
+      return;
+    }
+    auto base = fn->nextReg();
+    for (; std::next(it) != end; it++) {
+      visit(*this, *it);
+      if (error)
+        return;
+      // Only the last value is kept.
+      fn->expr2nextReg(*e);
+      fn->setNextReg(base);
+    }
+    visitTail(*it, isTail);
+  }
+
+  void ifCall(const MALList &l, bool isTail) {
+    if (l.size() < 3) {
+      error = std::make_shared<MALError>("Not enough arguments to if");
+      return;
+    }
+    if (l.size() > 4) {
+      error = std::make_shared<MALError>("Too many arguments to if");
+      return;
+    }
+    auto &cond = l.rest->first;
+    auto &then = l.rest->rest->first;
+    auto otherwise = l.size() == 4 ? &l.rest->rest->rest->first : nullptr;
+    visit(*this, cond);
+    if (error)
+      return;
+    if (fn->optimize && FuncState::isConstant(*e)) {
+      // Only the branch that will be taken is compiled.
+      if (e->kind != ExpKind::NIL && e->kind != ExpKind::FALSE) {
+        visitTail(then, isTail);
+      } else if (otherwise) {
+        visitTail(*otherwise, isTail);
+      } else {
+        *e = ExpDesc();
       }
+      return;
+    }
+    auto jf = fn->jumpIfFalse(*e);
+
+    // Both branches leave their value in the same register, unless they
+    // return it.
+    auto target = fn->nextReg();
+    visitTail(then, isTail);
+    if (error)
+      return;
+    uint32_t jmp = 0;
+    if (isTail) {
+      fn->ret(*e);
     } else {
-      e->kind = ExpKind::NIL;
+      fn->expr2nextReg(*e);
+      assert(e->u.r == target);
+      jmp = fn->emit_ins(byteCode::AD(opCode::JMP, 0, 0));
+      fn->setNextReg(target);
     }
-    // fn->expr2Reg(*e, (reg)sc.nVars);
 
+    fn->patchJump(jf);
+    if (otherwise) {
+      visitTail(*otherwise, isTail);
+      if (error)
+        return;
+    } else {
+      *e = ExpDesc();
+    }
+    if (isTail) {
+      fn->ret(*e);
+    } else {
+      fn->expr2nextReg(*e);
+      assert(e->u.r == target);
+      fn->patchJump(jmp);
+    }
+  }
+
+  void quoteCall(const MALList &l) {
+    if (l.size() != 2) {
+      error = std::make_shared<MALError>("quote takes 1 argument");
+      return;
+    }
+    auto &m = l.rest->first;
+    if (!m.as<MALList>() && !m.as<MALVector>() && !m.as<MALSymbol>()) {
+      // Everything else evaluates to itself.
+      visit(*this, m);
+      return;
+    }
+    // The form lives in the reader's arena, so the constant is a heap copy.
+    auto k = fn->addConstant(promote(heap, m));
+    e->u.s.info = fn->emit_ins(byteCode::AD(opCode::CONST, 0, k));
+    e->kind = ExpKind::RELOCABLE;
+  }
+
+  void fnCall(const MALList &l) {
+    if (l.size() < 2) {
+      error = std::make_shared<MALError>("Not enough arguments to fn*");
+      return;
+    }
+    auto it = ++l.begin();
+    auto params = visit(Iterator{}, *it);
+    if (!params.valid) {
+      error = std::make_shared<MALError>("fn* parameters aren't a sequence");
+      return;
+    }
+    auto end = params.end();
+
+    FuncState child(*fn);
+    child.chunk->name = std::exchange(fnName, {});
+    if (auto name = std::exchange(fnGlobal, {}); !name.empty()) {
+      child.definedAs = std::move(name);
+    }
+    child.chunk->line = line;
+    Scope sc;
+    sc.isFunction = true;
+    child.beginScope(sc);
+    for (auto ptr = params.begin(); ptr != end; ptr++) {
+      auto s = ptr->as<MALSymbol>();
+      if (!s) {
+        error = std::make_shared<MALError>("fn* parameters must be symbols");
+        break;
+      }
+      if (s->symbol == "&") {
+        ptr++;
+        if (ptr == end || !ptr->as<MALSymbol>() || std::next(ptr) != end) {
+          error = std::make_shared<MALError>(
+              "& must be followed by exactly one parameter");
+          break;
+        }
+        child.chunk->variadic = true;
+        s = ptr->as<MALSymbol>();
+      } else {
+        child.chunk->numParams++;
+      }
+      auto r = child.regReserve(1);
+      if (error) {
+        break;
+      }
+      child.addLocal(s->symbol, r);
+    }
+    if (error) {
+      child.endScope();
+      return;
+    }
+
+    auto parent = fn;
+    fn = &child;
+    ExpDesc *e_cache = e;
+    ExpDesc result;
+    e = &result;
+    body(++it, l.end(), true);
+    if (!error) {
+      fn->ret(result);
+    }
     fn->endScope();
-    // if (e->kind == ExpKind::LOCAL) {
-    //   fn->regReserve(1);
-    // }
+    fn = parent;
+    e = e_cache;
+    if (error)
+      return;
+
+    auto proto = heap.alloc<MALProto>(child.getChunk());
+    auto k = fn->addConstant(MALType{proto});
+    e->u.s.info = fn->emit_ins(byteCode::AD(opCode::CLOSURE, 0, k));
+    e->kind = ExpKind::RELOCABLE;
   }
 };
 
-bool MALState::compile(int r) {
-  auto &code = state->stack[(size_t)r];
+bool MALState::State::compile(MALType form, int r,
+                              std::shared_ptr<const std::string> file) {
   ExpDesc e;
-  auto compiler = Compiler(e);
-  std::visit(compiler, code.data);
+  std::sort(lines.begin(), lines.end(), [](auto &a, auto &b) {
+    return std::less<const MALObject *>()(a.form, b.form);
+  });
+  auto compiler = Compiler(e, heap, globals, optimize, lines, file);
+  visit(compiler, form);
+  // The form is done with, and nothing compiled refers to the arena.
+  resetArena();
   if (compiler.error) {
-    state->error = compiler.error;
+    error = compiler.error;
+    if (file && compiler.line) {
+      error->location = *file + ":" + std::to_string(compiler.line);
+    }
     return false;
   }
   compiler.fn->expr2Reg(e, (reg)r);
   if (compiler.error) {
-    state->error = compiler.error;
+    error = compiler.error;
     return false;
   }
-  state->chunk = compiler.fn->getChunk();
+  compiler.fn->emit_ins(byteCode::AD(opCode::RETURN, (reg)r, 0));
+  auto chunk = compiler.fn->getChunk();
+  chunk->frameSize = std::max(chunk->frameSize, (uint16_t)(r + 1));
+  proto = heap.alloc<MALProto>(std::move(chunk));
   return true;
 }
+
+bool MALState::compile(int r) {
+  auto &code = state->stack[(size_t)r];
+  auto form = code;
+  // The register mustn't keep pointing into the arena once it is reset.
+  code = MALType();
+  return state->compile(form, r);
+}
@@ -12,6 +12,14 @@ static void instructionAD(const char *op, const byteCode &b) {
   std::cout << op << " register " << d << " to register " << a << "\n";
 }
 
+static void instructionABC(const char *op, const byteCode &b) {
+  uint16_t a = b.regA();
+  uint16_t bb = b.regB();
+  uint16_t c = b.regC();
+  std::cout << op << " registers " << bb << ", " << c << " to register " << a
+            << "\n";
+}
+
 #define BUILD_DISASSEMBLY(op, type)                                            \
   case opCode::op:                                                             \
     instruction##type(#op, b);                                                 \
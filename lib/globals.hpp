@@ -0,0 +1,49 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Global variables live in numbered slots. The compiler resolves each name to
+// its slot once, so the VM only has to index into values.
+struct Globals {
+  // Instructions name a slot with a 16 bit operand.
+  static constexpr size_t MAX_SLOTS =
+      (size_t)std::numeric_limits<uint16_t>::max() + 1;
+
+  // Whether name has a slot, or there is still room to give it one. Slots are
+  // never given back, so this must be checked before any new name is used.
+  inline bool hasRoom(const std::string &name) const {
+    return values.size() < MAX_SLOTS || slots.count(name);
+  };
+
+  uint16_t slot(const std::string &name) {
+    auto it = slots.find(name);
+    if (it != slots.end()) {
+      return it->second;
+    }
+    assert(values.size() < MAX_SLOTS);
+    auto s = (uint16_t)values.size();
+    slots.emplace(name, s);
+    names.push_back(name);
+    values.push_back(MALType::undefined());
+    return s;
+  };
+
+  inline bool isDefined(uint16_t s) const { return !values[s].isUndefined(); };
+
+  inline void define(const std::string &name, MALType m) {
+    values[slot(name)] = m;
+  };
+
+  std::vector<MALType> values;
+  std::vector<std::string> names;
+
+private:
+  std::unordered_map<std::string, uint16_t> slots;
+};
@@ -0,0 +1,221 @@
+#include "heap.hpp"
+
+#include "chunk.hpp"
+#include "state.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+
+#define BUILD_FREE_CASE(type, T)                                               \
+  case ObjType::type:                                                          \
+    delete static_cast<T *>(obj);                                              \
+    break
+
+void freeObject(MALObject *obj) {
+  switch (obj->type) { OBJECT_BUILDER(BUILD_FREE_CASE, ;); }
+}
+
+size_t objectSize(const MALObject *obj) {
+  switch (obj->type) {
+  case ObjType::List:
+    return sizeof(MALList);
+  case ObjType::Vector: {
+    auto v = static_cast<const MALVector *>(obj);
+    return sizeof(MALVector) + v->tail.capacity() * sizeof(MALType);
+  }
+  case ObjType::VecNode:
+    return sizeof(MALVecNode);
+  case ObjType::Map:
+    return sizeof(MALMap);
+  case ObjType::MapNode:
+    return sizeof(MALMapNode) +
+           static_cast<const MALMapNode *>(obj)->slots.capacity() *
+               sizeof(MALType);
+  case ObjType::Symbol:
+    return sizeof(MALSymbol) +
+           static_cast<const MALSymbol *>(obj)->symbol.size();
+  case ObjType::Keyword:
+    return sizeof(MALKeyword) +
+           static_cast<const MALKeyword *>(obj)->keyword.size();
+  case ObjType::String:
+    return sizeof(MALString) + static_cast<const MALString *>(obj)->str.size();
+  case ObjType::CFunc:
+    return sizeof(MALCFunc);
+  case ObjType::Proto: {
+    auto &c = *static_cast<const MALProto *>(obj)->chunk;
+    return sizeof(MALProto) + sizeof(Chunk) +
+           c.code.capacity() * sizeof(byteCode) +
+           c.constants.capacity() * sizeof(MALType) +
+           c.upvalues.capacity() * sizeof(UpvalDesc);
+  }
+  case ObjType::Closure:
+    return sizeof(MALClosure) + static_cast<const MALClosure *>(obj)
+                                        ->upvalues.capacity() *
+                                    sizeof(MALUpvalue *);
+  case ObjType::Upvalue:
+    return sizeof(MALUpvalue);
+  case ObjType::Int:
+    return sizeof(MALInt);
+  }
+  return 0;
+}
+
+Heap::~Heap() {
+  while (objects) {
+    auto next = objects->next;
+    freeObject(objects);
+    objects = next;
+  }
+}
+
+MALSymbol *Heap::intern(std::string_view name) {
+  return internIn<MALSymbol, &MALSymbol::symbol>(symbols, name);
+}
+
+MALKeyword *Heap::internKeyword(std::string_view name) {
+  return internIn<MALKeyword, &MALKeyword::keyword>(keywords, name);
+}
+
+MALString *Heap::internString(std::string_view str) {
+  return internIn<MALString, &MALString::str>(strings, str);
+}
+
+void Heap::shareInterned(Heap &other, Forwarding &forward) {
+  shareIn(symbols, other.symbols, forward);
+  shareIn(keywords, other.keywords, forward);
+  shareIn(strings, other.strings, forward);
+}
+
+void Heap::adopt(Heap &other) {
+  if (!other.objects) {
+    return;
+  }
+  auto last = other.objects;
+  for (;; last = last->next) {
+    last->marked = false;
+    if (!last->next) {
+      break;
+    }
+  }
+  last->next = objects;
+  objects = other.objects;
+  bytesAllocated += other.bytesAllocated;
+  other.objects = nullptr;
+  other.bytesAllocated = 0;
+}
+
+void Heap::mark(MALObject *obj) {
+  if (obj->marked) {
+    return;
+  }
+  obj->marked = true;
+  gray.push_back(obj);
+}
+
+void Heap::blacken(MALObject *obj) {
+  switch (obj->type) {
+  case ObjType::List: {
+    auto l = static_cast<MALList *>(obj);
+    mark(l->first);
+    if (l->rest) {
+      mark(l->rest);
+    }
+    break;
+  }
+  case ObjType::Vector: {
+    auto v = static_cast<MALVector *>(obj);
+    if (v->root) {
+      mark(v->root);
+    }
+    for (auto &m : v->tail) {
+      mark(m);
+    }
+    break;
+  }
+  case ObjType::VecNode:
+    for (auto &m : static_cast<MALVecNode *>(obj)->slots) {
+      mark(m);
+    }
+    break;
+  case ObjType::Map:
+    if (auto root = static_cast<MALMap *>(obj)->root) {
+      mark(root);
+    }
+    break;
+  case ObjType::MapNode:
+    for (auto &m : static_cast<MALMapNode *>(obj)->slots) {
+      mark(m);
+    }
+    break;
+  case ObjType::Proto:
+    for (auto &m : static_cast<MALProto *>(obj)->chunk->constants) {
+      mark(m);
+    }
+    break;
+  case ObjType::Closure: {
+    auto cl = static_cast<MALClosure *>(obj);
+    mark(cl->proto);
+    for (auto uv : cl->upvalues) {
+      mark(uv);
+    }
+    break;
+  }
+  case ObjType::Upvalue:
+    mark(*static_cast<MALUpvalue *>(obj)->v);
+    break;
+  case ObjType::Symbol:
+  case ObjType::Keyword:
+  case ObjType::String:
+  case ObjType::CFunc:
+  case ObjType::Int:
+    break;
+  }
+}
+
+void Heap::collect() {
+  while (!gray.empty()) {
+    auto obj = gray.back();
+    gray.pop_back();
+    blacken(obj);
+  }
+  prune(symbols);
+  prune(keywords);
+  prune(strings);
+  sweep();
+  nextGC = std::max(bytesAllocated * GC_GROWTH, INITIAL_GC);
+}
+
+void Heap::sweep() {
+  bytesAllocated = 0;
+  MALObject **link = &objects;
+  while (*link) {
+    auto obj = *link;
+    if (obj->marked) {
+      obj->marked = false;
+      bytesAllocated += objectSize(obj);
+      link = &obj->next;
+    } else {
+      *link = obj->next;
+      freeObject(obj);
+    }
+  }
+}
+
+void MALState::State::collectGarbage() {
+  for (auto &m : stack) {
+    heap.mark(m);
+  }
+  for (auto &f : frames) {
+    heap.mark(f.fn);
+  }
+  for (auto &m : globals.values) {
+    heap.mark(m);
+  }
+  if (proto) {
+    heap.mark(proto);
+  }
+  for (auto uv = openUpvalues; uv; uv = uv->nextOpen) {
+    heap.mark(uv);
+  }
+  heap.collect();
+}
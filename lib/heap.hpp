@@ -0,0 +1,132 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Owns every object reachable from a MALType and reclaims them with a precise
+// mark-sweep collector. The heap doesn't know about roots; the owning State
+// marks them and then calls collect().
+//
+// Collection only happens at safe points chosen by the VM, where every live
+// value is reachable from the stack, globals or the current chunk. That lets
+// C code hold raw object pointers between allocations.
+struct Heap {
+  Heap() : objects(nullptr), bytesAllocated(0), nextGC(INITIAL_GC){};
+  ~Heap();
+
+  Heap(const Heap &) = delete;
+  Heap &operator=(const Heap &) = delete;
+
+  template <typename T, typename... Args> T *alloc(Args &&...args) {
+    auto obj = new T(std::forward<Args>(args)...);
+    bytesAllocated += objectSize(obj);
+#ifdef MAL_INSTRUMENT
+    allocations++;
+#endif
+    obj->next = objects;
+    objects = obj;
+    return obj;
+  }
+
+  // Symbols are interned so that equal names share one object. The table is
+  // weak; a symbol only referenced from here is still collected.
+  MALSymbol *intern(std::string_view name);
+  // Keywords and string constants are immutable, so they are interned the
+  // same way and shared between all chunks that use them.
+  MALKeyword *internKeyword(std::string_view name);
+  MALString *internString(std::string_view str);
+
+  typedef std::unordered_map<MALObject *, MALObject *> Forwarding;
+
+  // Objects built on another thread go in a Heap of their own, which is then
+  // merged into this one in two steps. shareInterned() moves other's interned
+  // atoms into this heap's tables. Those this heap already had are mapped to
+  // its copies in forward, and left marked so that they are cheap to spot.
+  // Once every reference to them has been replaced, adopt() takes over all of
+  // other's objects, and the duplicates are freed by the next collection.
+  void shareInterned(Heap &other, Forwarding &forward);
+  void adopt(Heap &other);
+
+  inline bool shouldCollect() const { return bytesAllocated > nextGC; };
+
+#ifdef MAL_INSTRUMENT
+  uint64_t allocations = 0; // Objects allocated so far, for VMStats.
+#endif
+
+  void mark(MALType m) {
+    if (m.isObj()) {
+      mark(m.asObj());
+    }
+  };
+  void mark(MALObject *obj);
+
+  // Traces everything reachable from the marked roots, then frees the rest.
+  void collect();
+
+private:
+  void blacken(MALObject *obj);
+  void sweep();
+
+  template <typename T, std::string T::*key>
+  T *internIn(std::unordered_map<std::string_view, T *> &table,
+              std::string_view name) {
+    auto it = table.find(name);
+    if (it != table.end()) {
+      return it->second;
+    }
+    auto obj = alloc<T>(std::string(name));
+    table.emplace(obj->*key, obj);
+    return obj;
+  }
+
+  template <typename T>
+  static void shareIn(std::unordered_map<std::string_view, T *> &table,
+                      std::unordered_map<std::string_view, T *> &from,
+                      Forwarding &forward) {
+    for (auto &[name, obj] : from) {
+      auto [it, added] = table.emplace(name, obj);
+      if (!added) {
+        forward.emplace(obj, it->second);
+        obj->marked = true;
+      }
+    }
+    from.clear();
+  }
+
+  // Drops the entries of a weak table whose objects are about to be swept.
+  template <typename T>
+  static void prune(std::unordered_map<std::string_view, T *> &table) {
+    for (auto it = table.begin(); it != table.end();) {
+      if (it->second->marked) {
+        it++;
+      } else {
+        it = table.erase(it);
+      }
+    }
+  }
+
+  static constexpr size_t INITIAL_GC = 1024 * 1024;
+  static constexpr size_t GC_GROWTH = 2;
+
+  MALObject *objects;
+  std::vector<MALObject *> gray;
+  std::unordered_map<std::string_view, MALSymbol *> symbols;
+  std::unordered_map<std::string_view, MALKeyword *> keywords;
+  std::unordered_map<std::string_view, MALString *> strings;
+  size_t bytesAllocated;
+  size_t nextGC;
+};
+
+// An integer value, boxed on heap if it doesn't fit inline.
+inline MALType makeInt(Heap &heap, int64_t n) {
+  return MALType::fitsInline(n) ? MALType{n} : MALType{heap.alloc<MALInt>(n)};
+}
+
+size_t objectSize(const MALObject *obj);
+void freeObject(MALObject *obj);
@@ -0,0 +1,417 @@
+#include "image.hpp"
+
+#include "chunk.hpp"
+#include "globals.hpp"
+#include "heap.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Tags the constants of a prototype, and the elements of quoted data.
+enum class ImageTag : uint8_t {
+  Nil,
+  True,
+  False,
+  Int,
+  Double,
+  Symbol,
+  Keyword,
+  String,
+  List,
+  Vector,
+  Proto,
+};
+
+static inline bool isGlobalOp(opCode op) {
+  return op == opCode::GLOBAL_GET || op == opCode::GLOBAL_GET_CHECK ||
+         op == opCode::GLOBAL_SET;
+}
+
+bool ImageWriter::add(const MALProto &proto) {
+  if (!putChunk(*proto.chunk)) {
+    return false;
+  }
+  formCount++;
+  return true;
+}
+
+void ImageWriter::putString(const std::string &str) {
+  put((uint32_t)str.size());
+  body += str;
+}
+
+bool ImageWriter::putChunk(const Chunk &chunk) {
+  put((uint32_t)chunk.code.size());
+  put(chunk.frameSize);
+  put(chunk.numParams);
+  put((uint8_t)chunk.variadic);
+  put((uint16_t)chunk.upvalues.size());
+  put((uint16_t)chunk.constants.size());
+  body.append(reinterpret_cast<const char *>(chunk.code.data()),
+              chunk.code.size() * sizeof(byteCode));
+  for (auto &uv : chunk.upvalues) {
+    put((uint8_t)uv.inStack);
+    put(uv.index);
+  }
+  putString(chunk.name);
+  putString(chunk.file ? *chunk.file : std::string());
+  put(chunk.line);
+  put((uint32_t)chunk.lines.size());
+  body.append(reinterpret_cast<const char *>(chunk.lines.data()),
+              chunk.lines.size() * sizeof(LineInfo));
+  for (auto &k : chunk.constants) {
+    if (!putConstant(k)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ImageWriter::putConstant(MALType m) {
+  if (m.isNil()) {
+    put(ImageTag::Nil);
+  } else if (m.isBool()) {
+    put(m.asBool() ? ImageTag::True : ImageTag::False);
+  } else if (m.isInt()) {
+    put(ImageTag::Int);
+    put(m.asInt());
+  } else if (m.isDouble()) {
+    put(ImageTag::Double);
+    put(m.asDouble());
+  } else if (auto n = m.as<MALInt>()) {
+    put(ImageTag::Int);
+    put(n->value);
+  } else if (auto sym = m.as<MALSymbol>()) {
+    put(ImageTag::Symbol);
+    putString(sym->symbol);
+  } else if (auto kw = m.as<MALKeyword>()) {
+    put(ImageTag::Keyword);
+    putString(kw->keyword);
+  } else if (auto str = m.as<MALString>()) {
+    put(ImageTag::String);
+    putString(str->str);
+  } else if (m.as<MALList>() || m.as<MALVector>()) {
+    put(m.as<MALList>() ? ImageTag::List : ImageTag::Vector);
+    auto seq = visit(Iterator{}, m);
+    put((uint32_t)seq.size());
+    for (auto &e : seq) {
+      if (!putConstant(e)) {
+        return false;
+      }
+    }
+  } else if (auto proto = m.as<MALProto>()) {
+    put(ImageTag::Proto);
+    return putChunk(*proto->chunk);
+  } else {
+    error = std::make_shared<MALError>("Can't save " + std::string(m) +
+                                       " in an image");
+    return false;
+  }
+  return true;
+}
+
+bool ImageWriter::write(const std::string &path, const Globals &globals) {
+  ImageHeader header;
+  std::memcpy(header.magic, ImageHeader::MAGIC, sizeof(header.magic));
+  header.version = ImageHeader::VERSION;
+  header.byteOrder = ImageHeader::BYTE_ORDER_MARK;
+  header.globalCount = (uint32_t)globals.names.size();
+  header.formCount = formCount;
+
+  std::string out(reinterpret_cast<const char *>(&header), sizeof(header));
+  body.swap(out);
+  for (auto &name : globals.names) {
+    putString(name);
+  }
+  body.swap(out);
+  out += body;
+  return writeFileAtomically(path, out, error);
+}
+
+static bool writeAll(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    auto n = ::write(fd, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      return false;
+    }
+    data += n;
+    size -= (size_t)n;
+  }
+  return true;
+}
+
+bool writeFileAtomically(const std::string &path, const std::string &data,
+                         std::shared_ptr<MALError> &error) {
+  // Write to a temporary file and rename it into place, so that readers
+  // never see a partly written file.
+  auto tmp = path + ".tmp";
+  auto fd =
+      ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    error = std::make_shared<MALError>(tmp + ": " + std::strerror(errno));
+    return false;
+  }
+  bool ok = writeAll(fd, data.data(), data.size());
+  auto err = errno;
+  if (close(fd) != 0 && ok) {
+    ok = false;
+    err = errno;
+  }
+  if (ok && std::rename(tmp.c_str(), path.c_str()) != 0) {
+    ok = false;
+    err = errno;
+  }
+  if (!ok) {
+    error = std::make_shared<MALError>(path + ": " + std::strerror(err));
+    unlink(tmp.c_str());
+  }
+  return ok;
+}
+
+ImageReader::ImageReader(const char *data, size_t size)
+    : data(data), cur(data), end(data + size), size(size), formsLeft(0) {}
+
+ImageReader::~ImageReader() {
+  munmap(const_cast<char *>(data), size);
+}
+
+std::unique_ptr<ImageReader>
+ImageReader::open(const std::string &path, Globals &globals,
+                  std::shared_ptr<MALError> &error) {
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    error = std::make_shared<MALError>(path + ": " + std::strerror(errno));
+    return nullptr;
+  }
+  // Check the magic before mapping, since most files loaded are source.
+  ImageHeader header;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      (size_t)st.st_size < sizeof(header) ||
+      pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      std::memcmp(header.magic, ImageHeader::MAGIC, sizeof(header.magic))) {
+    close(fd);
+    return nullptr;
+  }
+  if (header.version != ImageHeader::VERSION ||
+      header.byteOrder != ImageHeader::BYTE_ORDER_MARK) {
+    close(fd);
+    error = std::make_shared<MALError>(
+        path + ": image was written by another version or machine");
+    return nullptr;
+  }
+  auto size = (size_t)st.st_size;
+  auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    error = std::make_shared<MALError>(path + ": " + std::strerror(errno));
+    return nullptr;
+  }
+  madvise(data, size, MADV_SEQUENTIAL);
+
+  auto in = std::unique_ptr<ImageReader>(
+      new ImageReader(static_cast<const char *>(data), size));
+  in->cur += sizeof(header);
+  in->formsLeft = header.formCount;
+  for (uint32_t i = 0; i < header.globalCount; i++) {
+    std::string_view name;
+    if (!in->getString(name)) {
+      error = in->error;
+      return nullptr;
+    }
+    auto str = std::string(name);
+    if (!globals.hasRoom(str)) {
+      error = std::make_shared<MALError>(path + ": too many globals");
+      return nullptr;
+    }
+    in->slots.push_back(globals.slot(str));
+  }
+  return in;
+}
+
+bool ImageReader::fail() {
+  if (!error) {
+    error = std::make_shared<MALError>("Corrupt image");
+  }
+  return false;
+}
+
+bool ImageReader::getString(std::string_view &str) {
+  uint32_t len;
+  if (!get(len) || (size_t)(end - cur) < len) {
+    return fail();
+  }
+  str = std::string_view(cur, len);
+  cur += len;
+  return true;
+}
+
+bool ImageReader::next(Heap &heap, Globals &globals, MALProto *&proto) {
+  if (formsLeft == 0) {
+    return false;
+  }
+  formsLeft--;
+  proto = getProto(heap, globals);
+  return proto != nullptr;
+}
+
+MALProto *ImageReader::getProto(Heap &heap, Globals &globals) {
+  uint32_t codeSize;
+  uint8_t variadic;
+  uint16_t upvalueCount, constantCount;
+  auto chunk = std::make_unique<Chunk>();
+  if (!get(codeSize) || !get(chunk->frameSize) || !get(chunk->numParams) ||
+      !get(variadic) || !get(upvalueCount) || !get(constantCount) ||
+      (size_t)(end - cur) / sizeof(byteCode) < codeSize) {
+    fail();
+    return nullptr;
+  }
+  chunk->variadic = variadic;
+
+  // The code is used as it is, apart from the global slots.
+  chunk->code.resize(codeSize);
+  std::memcpy(chunk->code.data(), cur, codeSize * sizeof(byteCode));
+  cur += codeSize * sizeof(byteCode);
+  for (auto &ins : chunk->code) {
+    if (!isGlobalOp(ins.op())) {
+      continue;
+    }
+    if (ins.regD() >= slots.size()) {
+      fail();
+      return nullptr;
+    }
+    ins.setD(slots[ins.regD()]);
+    // The compiler only skips the check for globals it saw defined. They
+    // will be by now too when the image runs its forms in the same order,
+    // but the VM mustn't rely on that.
+    if (ins.op() == opCode::GLOBAL_GET && !globals.isDefined(ins.regD())) {
+      ins.setOp(opCode::GLOBAL_GET_CHECK);
+    }
+  }
+
+  for (uint16_t i = 0; i < upvalueCount; i++) {
+    uint8_t inStack;
+    reg index;
+    if (!get(inStack) || !get(index)) {
+      fail();
+      return nullptr;
+    }
+    chunk->upvalues.push_back(UpvalDesc{inStack != 0, index});
+  }
+
+  std::string_view name, file;
+  uint32_t lineCount;
+  if (!getString(name) || !getString(file) || !get(chunk->line) ||
+      !get(lineCount) ||
+      (size_t)(end - cur) / sizeof(LineInfo) < lineCount) {
+    fail();
+    return nullptr;
+  }
+  chunk->name = name;
+  if (!file.empty()) {
+    // Every prototype from one file shares a copy of its name.
+    if (!this->file || *this->file != file) {
+      this->file = std::make_shared<const std::string>(file);
+    }
+    chunk->file = this->file;
+  }
+  chunk->lines.resize(lineCount);
+  std::memcpy(chunk->lines.data(), cur, lineCount * sizeof(LineInfo));
+  cur += lineCount * sizeof(LineInfo);
+
+  for (uint16_t i = 0; i < constantCount; i++) {
+    MALType k;
+    if (!getConstant(heap, globals, k)) {
+      fail();
+      return nullptr;
+    }
+    chunk->constants.push_back(k);
+  }
+  return heap.alloc<MALProto>(std::move(chunk));
+}
+
+bool ImageReader::getConstant(Heap &heap, Globals &globals, MALType &m) {
+  ImageTag tag;
+  if (!get(tag)) {
+    return false;
+  }
+  switch (tag) {
+  case ImageTag::Nil:
+    m = MALType();
+    return true;
+  case ImageTag::True:
+  case ImageTag::False:
+    m = MALType{tag == ImageTag::True};
+    return true;
+  case ImageTag::Int: {
+    int64_t n;
+    if (!get(n)) {
+      return false;
+    }
+    m = makeInt(heap, n);
+    return true;
+  }
+  case ImageTag::Double: {
+    double x;
+    if (!get(x)) {
+      return false;
+    }
+    m = MALType{x};
+    return true;
+  }
+  case ImageTag::Symbol:
+  case ImageTag::Keyword:
+  case ImageTag::String: {
+    std::string_view str;
+    if (!getString(str)) {
+      return false;
+    }
+    if (tag == ImageTag::Symbol) {
+      m = MALType{heap.intern(str)};
+    } else if (tag == ImageTag::Keyword) {
+      m = MALType{heap.internKeyword(str)};
+    } else {
+      m = MALType{heap.internString(str)};
+    }
+    return true;
+  }
+  case ImageTag::List:
+  case ImageTag::Vector: {
+    uint32_t count;
+    if (!get(count) || (size_t)(end - cur) < count) {
+      return fail();
+    }
+    std::vector<MALType> items(count);
+    for (auto &e : items) {
+      if (!getConstant(heap, globals, e)) {
+        return false;
+      }
+    }
+    auto begin = items.data();
+    if (tag == ImageTag::List) {
+      m = MALType{MALList::from(heap, begin, begin + count)};
+    } else {
+      m = MALType{MALVector::from(heap, begin, begin + count)};
+    }
+    return true;
+  }
+  case ImageTag::Proto: {
+    auto proto = getProto(heap, globals);
+    m = MALType{proto};
+    return proto != nullptr;
+  }
+  }
+  return fail();
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct Chunk;
+struct Globals;
+struct Heap;
+
+// A bytecode image holds compiled top level forms, so that a program can be
+// run again without reading or compiling its source.
+//
+// An image starts with a header, then the names of the global slots its code
+// was compiled against, then each form's prototype. A prototype is its frame
+// layout, its code exactly as the VM runs it, its upvalue descriptors, its
+// name, file and line table, and its constants, with nested prototypes inline
+// among the constants. Integers are
+// in host byte order; the header records which, and the version is bumped
+// whenever the layout or the instruction set changes.
+//
+// Code refers to globals by slot, which depends on the order the names were
+// first seen, so loading renumbers the global instructions. That and
+// interning the constants are the only fixups. Like source, images are
+// trusted: the layout is checked as it is read, but the code isn't verified.
+struct ImageHeader {
+  static constexpr char MAGIC[4] = {'\x7f', 'M', 'A', 'L'};
+  static constexpr uint16_t VERSION = 3;
+  static constexpr uint16_t BYTE_ORDER_MARK = 0x0102;
+
+  char magic[4];
+  uint16_t version;
+  uint16_t byteOrder;
+  uint32_t globalCount;
+  uint32_t formCount;
+};
+
+// Writes data to path, replacing any file there only once all of data has
+// been written.
+bool writeFileAtomically(const std::string &path, const std::string &data,
+                         std::shared_ptr<MALError> &error);
+
+// Collects compiled top level forms and writes them out as an image.
+struct ImageWriter {
+  // Adds a top level form. Fails if one of its constants can't be saved.
+  bool add(const MALProto &proto);
+  // Writes the image to path.
+  bool write(const std::string &path, const Globals &globals);
+
+  std::shared_ptr<MALError> error;
+
+private:
+  template <typename T> void put(T v) {
+    body.append(reinterpret_cast<const char *>(&v), sizeof(v));
+  }
+  void putString(const std::string &str);
+  bool putChunk(const Chunk &chunk);
+  bool putConstant(MALType m);
+
+  std::string body; // The forms added so far.
+  uint32_t formCount = 0;
+};
+
+// Loads the forms of a mapped image one at a time.
+struct ImageReader {
+  ~ImageReader();
+
+  ImageReader(const ImageReader &) = delete;
+  ImageReader &operator=(const ImageReader &) = delete;
+
+  // Opens the image at path, resolving the names of its globals in globals.
+  // Returns nullptr with error set on failure, and nullptr without error if
+  // path isn't an image at all.
+  static std::unique_ptr<ImageReader> open(const std::string &path,
+                                           Globals &globals,
+                                           std::shared_ptr<MALError> &error);
+
+  // Loads the next form onto heap. Returns false at the end of the image, or
+  // on failure with error set.
+  bool next(Heap &heap, Globals &globals, MALProto *&proto);
+
+  std::shared_ptr<MALError> error;
+
+private:
+  ImageReader(const char *data, size_t size);
+
+  template <typename T> bool get(T &v) {
+    if ((size_t)(end - cur) < sizeof(v)) {
+      return fail();
+    }
+    std::memcpy(&v, cur, sizeof(v));
+    cur += sizeof(v);
+    return true;
+  }
+  bool getString(std::string_view &str);
+  MALProto *getProto(Heap &heap, Globals &globals);
+  bool getConstant(Heap &heap, Globals &globals, MALType &m);
+  bool fail();
+
+  const char *data; // The mapping.
+  const char *cur;
+  const char *end;
+  size_t size;
+  uint32_t formsLeft;
+  std::vector<uint16_t> slots; // The slot of each of the image's globals.
+  std::shared_ptr<const std::string> file; // The last file name read.
+};
@@ -0,0 +1,80 @@
+#include "instrument.hpp"
+
+#ifdef MAL_INSTRUMENT
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#define BUILD_OPCODE_NAMES(op, _) #op
+const char *const opcodeNames[OPCODE_COUNT] = {
+    OPCODE_BUILDER(BUILD_OPCODE_NAMES, COMMA)};
+
+// The longest tables are cut off after this many rows.
+static constexpr size_t MAX_ROWS = 20;
+
+template <typename T>
+static void sortByCount(std::vector<std::pair<T, uint64_t>> &rows) {
+  std::stable_sort(rows.begin(), rows.end(), [](auto &a, auto &b) {
+    return a.second > b.second;
+  });
+}
+
+void VMStats::dump(std::ostream &out) const {
+  char line[128];
+  uint64_t total = 0;
+  std::vector<std::pair<size_t, uint64_t>> rows;
+  for (size_t i = 0; i < OPCODE_COUNT; i++) {
+    total += ops[i];
+    if (ops[i] > 0) {
+      rows.push_back({i, ops[i]});
+    }
+  }
+  if (total == 0) {
+    return;
+  }
+  sortByCount(rows);
+  out << "opcode                 count      %     allocs\n";
+  for (auto &[op, n] : rows) {
+    std::snprintf(line, sizeof(line),
+                  "%-16s %12" PRIu64 " %6.2f %10" PRIu64 "\n", opcodeNames[op],
+                  n, 100.0 * (double)n / (double)total, allocs[op]);
+    out << line;
+  }
+
+  rows.clear();
+  for (size_t i = 0; i < OPCODE_COUNT; i++) {
+    for (size_t j = 0; j < OPCODE_COUNT; j++) {
+      if (pairs[i][j] > 0) {
+        rows.push_back({i * OPCODE_COUNT + j, pairs[i][j]});
+      }
+    }
+  }
+  sortByCount(rows);
+  out << "\nopcode pair                          count\n";
+  for (size_t i = 0; i < std::min(rows.size(), MAX_ROWS); i++) {
+    auto [pair, n] = rows[i];
+    std::snprintf(line, sizeof(line), "%-16s %-16s %10" PRIu64 "\n",
+                  opcodeNames[pair / OPCODE_COUNT],
+                  opcodeNames[pair % OPCODE_COUNT], n);
+    out << line;
+  }
+
+  std::vector<std::pair<const std::string *, uint64_t>> fns;
+  for (auto &[name, s] : cfuncs) {
+    fns.push_back({&name, s.ns});
+  }
+  sortByCount(fns);
+  out << "\nbuiltin               calls       ms    ns/call\n";
+  for (auto &[name, ns] : fns) {
+    auto &s = cfuncs.at(*name);
+    std::snprintf(line, sizeof(line), "%-16s %10" PRIu64 " %8.2f %10.1f\n",
+                  name->c_str(), s.calls, (double)ns / 1e6,
+                  (double)ns / (double)s.calls);
+    out << line;
+  }
+}
+
+#endif
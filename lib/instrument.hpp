@@ -0,0 +1,84 @@
+#pragma once
+
+// Counters the VM keeps when built with MAL_INSTRUMENT, to show which opcodes
+// and builtins a program spends its time in. Without it the hooks expand to
+// nothing, so a normal build pays nothing for them.
+
+#ifdef MAL_INSTRUMENT
+
+#include "bytecode.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+#define COUNT_OPCODES(op, _) 1
+static constexpr size_t OPCODE_COUNT = OPCODE_BUILDER(COUNT_OPCODES, +) 0;
+
+extern const char *const opcodeNames[OPCODE_COUNT];
+
+struct VMStats {
+  typedef std::chrono::steady_clock Clock;
+
+  // Counts an instruction about to run. Objects allocated since the last
+  // one are charged to that one.
+  inline void count(opCode op, uint64_t allocations) {
+    auto i = (size_t)op;
+    ops[i]++;
+    if (prev < OPCODE_COUNT) {
+      pairs[prev][i]++;
+      allocs[prev] += allocations - lastAllocations;
+    }
+    prev = i;
+    lastAllocations = allocations;
+  };
+
+  // Brackets each run of the VM, so that pairs and allocations don't span
+  // the work done between runs.
+  inline void start(uint64_t allocations) {
+    prev = OPCODE_COUNT;
+    lastAllocations = allocations;
+  };
+  inline void stop(uint64_t allocations) {
+    if (prev < OPCODE_COUNT) {
+      allocs[prev] += allocations - lastAllocations;
+    }
+    prev = OPCODE_COUNT;
+  };
+
+  // Time spent in a C function, including any code it runs itself.
+  inline void cfunc(const std::string &name, Clock::duration time) {
+    auto &s = cfuncs[name];
+    s.calls++;
+    s.ns += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(time)
+                .count();
+  };
+
+  // Writes the counters as tables, busiest first, or nothing if no code ran.
+  void dump(std::ostream &out) const;
+
+  struct CFuncStats {
+    uint64_t calls = 0;
+    uint64_t ns = 0;
+  };
+
+  uint64_t ops[OPCODE_COUNT] = {};
+  uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT] = {};
+  uint64_t allocs[OPCODE_COUNT] = {}; // Objects allocated by each opcode.
+  std::unordered_map<std::string, CFuncStats> cfuncs;
+
+private:
+  size_t prev = OPCODE_COUNT; // The last opcode counted in this run.
+  uint64_t lastAllocations = 0;
+};
+
+#define INSTRUMENT(stmt) stmt
+
+#else
+
+#define INSTRUMENT(stmt)
+
+#endif
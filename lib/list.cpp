@@ -0,0 +1,23 @@
+#include "arena.hpp"
+#include "heap.hpp"
+#include "types.hpp"
+
+MALList *MALList::cons(Heap &heap, MALType m) {
+  return heap.alloc<MALList>(m, empty() ? nullptr : this);
+}
+
+template <typename A>
+MALList *MALList::from(A &alloc, const MALType *begin, const MALType *end) {
+  if (begin == end) {
+    return alloc.template alloc<MALList>();
+  }
+  // Built back to front, so each cell can point at the one after it.
+  MALList *ret = nullptr;
+  for (auto it = end; it != begin;) {
+    ret = alloc.template alloc<MALList>(*--it, ret);
+  }
+  return ret;
+}
+
+template MALList *MALList::from(Heap &, const MALType *, const MALType *);
+template MALList *MALList::from(Arena &, const MALType *, const MALType *);
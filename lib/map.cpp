@@ -0,0 +1,244 @@
+#include "heap.hpp"
+#include "types.hpp"
+
+#include <cassert>
+
+static constexpr uint32_t HAMT_MASK = (1u << HAMT_BITS) - 1;
+
+static inline uint32_t bitFor(uint32_t hash, unsigned shift) {
+  return 1u << ((hash >> shift) & HAMT_MASK);
+}
+
+// Position of bit's entry among those set in bitmap.
+static inline size_t indexOf(uint32_t bitmap, uint32_t bit) {
+  return popcount(bitmap & (bit - 1));
+}
+
+static inline bool isCollision(unsigned shift) { return shift >= HASH_BITS; }
+
+static inline size_t pairCount(const MALMapNode *node, unsigned shift) {
+  return isCollision(shift) ? node->slots.size() / 2 : popcount(node->datamap);
+}
+
+static inline MALMapNode *childAt(const MALMapNode *node, size_t i) {
+  return static_cast<MALMapNode *>(node->slots[i].asObj());
+}
+
+// Index of key's pair in a collision node, or -1.
+static ptrdiff_t findCollision(const MALMapNode *node, MALType key) {
+  for (size_t i = 0; i < node->slots.size(); i += 2) {
+    if (equals(node->slots[i], key)) {
+      return (ptrdiff_t)i;
+    }
+  }
+  return -1;
+}
+
+const MALType *MALMap::get(MALType key) const {
+  auto hash = hashValue(key);
+  const MALMapNode *node = root;
+  for (unsigned shift = 0; node; shift += HAMT_BITS) {
+    if (isCollision(shift)) {
+      auto i = findCollision(node, key);
+      return i < 0 ? nullptr : &node->slots[(size_t)i + 1];
+    }
+    auto bit = bitFor(hash, shift);
+    if (node->datamap & bit) {
+      auto i = 2 * indexOf(node->datamap, bit);
+      return equals(node->slots[i], key) ? &node->slots[i + 1] : nullptr;
+    }
+    if (!(node->nodemap & bit)) {
+      return nullptr;
+    }
+    node = childAt(node, 2 * pairCount(node, shift) +
+                             indexOf(node->nodemap, bit));
+  }
+  return nullptr;
+}
+
+// Returns a node holding just the two entries, whose keys differ but whose
+// hashes agree below shift.
+static MALMapNode *mergePairs(Heap &heap, MALType k1, MALType v1, uint32_t h1,
+                              MALType k2, MALType v2, uint32_t h2,
+                              unsigned shift) {
+  auto node = heap.alloc<MALMapNode>();
+  if (isCollision(shift)) {
+    node->slots = {k1, v1, k2, v2};
+    return node;
+  }
+  auto b1 = bitFor(h1, shift);
+  auto b2 = bitFor(h2, shift);
+  if (b1 == b2) {
+    node->nodemap = b1;
+    node->slots = {MALType{
+        mergePairs(heap, k1, v1, h1, k2, v2, h2, shift + HAMT_BITS)}};
+  } else {
+    node->datamap = b1 | b2;
+    node->slots = b1 < b2 ? std::vector<MALType>{k1, v1, k2, v2}
+                          : std::vector<MALType>{k2, v2, k1, v1};
+  }
+  return node;
+}
+
+static MALMapNode *assocNode(Heap &heap, MALMapNode *node, MALType key,
+                             MALType value, uint32_t hash, unsigned shift,
+                             bool &added) {
+  if (isCollision(shift)) {
+    auto ret = heap.alloc<MALMapNode>(*node);
+    auto i = findCollision(node, key);
+    if (i < 0) {
+      ret->slots.push_back(key);
+      ret->slots.push_back(value);
+      added = true;
+    } else {
+      ret->slots[(size_t)i + 1] = value;
+    }
+    return ret;
+  }
+
+  auto bit = bitFor(hash, shift);
+  auto pairs = pairCount(node, shift);
+  if (node->datamap & bit) {
+    auto i = 2 * indexOf(node->datamap, bit);
+    auto k = node->slots[i];
+    auto v = node->slots[i + 1];
+    if (equals(k, key)) {
+      if (v.bits == value.bits) {
+        return node;
+      }
+      auto ret = heap.alloc<MALMapNode>(*node);
+      ret->slots[i + 1] = value;
+      return ret;
+    }
+    // Both keys now need a node of their own one level down.
+    auto sub = mergePairs(heap, k, v, hashValue(k), key, value, hash,
+                          shift + HAMT_BITS);
+    added = true;
+    auto ret = heap.alloc<MALMapNode>(*node);
+    auto &slots = ret->slots;
+    slots.erase(slots.begin() + (ptrdiff_t)i, slots.begin() + (ptrdiff_t)i + 2);
+    ret->datamap ^= bit;
+    ret->nodemap |= bit;
+    auto j = 2 * (pairs - 1) + indexOf(ret->nodemap, bit);
+    slots.insert(slots.begin() + (ptrdiff_t)j, MALType{sub});
+    return ret;
+  }
+  if (node->nodemap & bit) {
+    auto j = 2 * pairs + indexOf(node->nodemap, bit);
+    auto child = childAt(node, j);
+    auto newChild =
+        assocNode(heap, child, key, value, hash, shift + HAMT_BITS, added);
+    if (newChild == child) {
+      return node;
+    }
+    auto ret = heap.alloc<MALMapNode>(*node);
+    ret->slots[j] = MALType{newChild};
+    return ret;
+  }
+  auto ret = heap.alloc<MALMapNode>(*node);
+  auto i = (ptrdiff_t)(2 * indexOf(node->datamap, bit));
+  ret->slots.insert(ret->slots.begin() + i, {key, value});
+  ret->datamap |= bit;
+  added = true;
+  return ret;
+}
+
+MALMap *MALMap::assoc(Heap &heap, MALType key, MALType value) const {
+  bool added = false;
+  auto hash = hashValue(key);
+  MALMapNode *newRoot;
+  if (root) {
+    newRoot = assocNode(heap, root, key, value, hash, 0, added);
+  } else {
+    auto node = heap.alloc<MALMapNode>();
+    node->datamap = bitFor(hash, 0);
+    node->slots = {key, value};
+    newRoot = node;
+    added = true;
+  }
+  auto ret = heap.alloc<MALMap>();
+  ret->cnt = cnt + added;
+  ret->root = newRoot;
+  return ret;
+}
+
+// Returns the node without key, or nullptr if that leaves it empty. Sets
+// removed if key was there.
+static MALMapNode *dissocNode(Heap &heap, MALMapNode *node, MALType key,
+                              uint32_t hash, unsigned shift, bool &removed) {
+  if (isCollision(shift)) {
+    auto i = findCollision(node, key);
+    if (i < 0) {
+      return node;
+    }
+    removed = true;
+    if (node->slots.size() == 2) {
+      return nullptr;
+    }
+    auto ret = heap.alloc<MALMapNode>(*node);
+    ret->slots.erase(ret->slots.begin() + i, ret->slots.begin() + i + 2);
+    return ret;
+  }
+
+  auto bit = bitFor(hash, shift);
+  auto pairs = pairCount(node, shift);
+  if (node->datamap & bit) {
+    auto i = (ptrdiff_t)(2 * indexOf(node->datamap, bit));
+    if (!equals(node->slots[(size_t)i], key)) {
+      return node;
+    }
+    removed = true;
+    if (node->slots.size() == 2) {
+      return nullptr;
+    }
+    auto ret = heap.alloc<MALMapNode>(*node);
+    ret->slots.erase(ret->slots.begin() + i, ret->slots.begin() + i + 2);
+    ret->datamap ^= bit;
+    return ret;
+  }
+  if (!(node->nodemap & bit)) {
+    return node;
+  }
+
+  auto j = 2 * pairs + indexOf(node->nodemap, bit);
+  auto child = childAt(node, j);
+  auto newChild =
+      dissocNode(heap, child, key, hash, shift + HAMT_BITS, removed);
+  if (newChild == child) {
+    return node;
+  }
+  auto ret = heap.alloc<MALMapNode>(*node);
+  auto &slots = ret->slots;
+  if (!newChild) {
+    slots.erase(slots.begin() + (ptrdiff_t)j);
+    ret->nodemap ^= bit;
+    return slots.empty() ? nullptr : ret;
+  }
+  if (newChild->slots.size() == 2 &&
+      pairCount(newChild, shift + HAMT_BITS) == 1) {
+    // Keep the trie canonical by pulling a lone entry up into this node.
+    slots.erase(slots.begin() + (ptrdiff_t)j);
+    ret->nodemap ^= bit;
+    ret->datamap |= bit;
+    auto i = (ptrdiff_t)(2 * indexOf(ret->datamap, bit));
+    slots.insert(slots.begin() + i, {newChild->slots[0], newChild->slots[1]});
+    return ret;
+  }
+  slots[j] = MALType{newChild};
+  return ret;
+}
+
+MALMap *MALMap::dissoc(Heap &heap, MALType key) const {
+  if (!root) {
+    return const_cast<MALMap *>(this);
+  }
+  bool removed = false;
+  auto newRoot = dissocNode(heap, root, key, hashValue(key), 0, removed);
+  if (!removed) {
+    return const_cast<MALMap *>(this);
+  }
+  auto ret = heap.alloc<MALMap>();
+  ret->cnt = cnt - 1;
+  ret->root = newRoot;
+  return ret;
+}
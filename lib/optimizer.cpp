@@ -0,0 +1,298 @@
+#include "optimizer.hpp"
+
+#include "bytecode.hpp"
+#include "chunk.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <bitset>
+#include <cassert>
+#include <vector>
+
+typedef std::bitset<MAX_REG + 1> RegSet;
+
+static inline bool isJump(opCode op) {
+  return op == opCode::JMP || op == opCode::JMPF;
+}
+
+static inline size_t jumpTarget(const byteCode &ins, size_t i) {
+  return (size_t)((ptrdiff_t)i + 1 + ins.regSD());
+}
+
+// Whether control can continue to the next instruction.
+static inline bool fallsThrough(opCode op) {
+  return op != opCode::JMP && op != opCode::RETURN && op != opCode::TAILCALL;
+}
+
+// Instructions whose only effect is writing R[A]. They may be removed when
+// R[A] is dead, or retargeted to write another register.
+static bool onlyWritesA(opCode op) {
+  switch (op) {
+  case opCode::CONST:
+  case opCode::GLOBAL_GET:
+  case opCode::PRIMITIVE:
+  case opCode::MOV:
+  case opCode::GET_UPVAL:
+  case opCode::CLOSURE:
+  case opCode::NEW_LIST:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Like onlyWritesA, but the instruction may also raise an error, so it can't
+// be removed.
+static bool retargetable(opCode op) {
+  switch (op) {
+  case opCode::GLOBAL_GET_CHECK:
+  case opCode::ADD:
+  case opCode::SUB:
+  case opCode::MUL:
+  case opCode::DIV:
+  case opCode::LT:
+  case opCode::LE:
+  case opCode::EQ:
+  case opCode::ADDK:
+  case opCode::SUBK:
+  case opCode::MULK:
+  case opCode::DIVK:
+  case opCode::LTK:
+  case opCode::LEK:
+  case opCode::GTK:
+  case opCode::GEK:
+  case opCode::EQK:
+    return true;
+  default:
+    return onlyWritesA(op);
+  }
+}
+
+static void usesAndDefs(const byteCode &ins, RegSet &uses, RegSet &defs) {
+  switch (ins.op()) {
+  case opCode::CONST:
+  case opCode::GLOBAL_GET:
+  case opCode::GLOBAL_GET_CHECK:
+  case opCode::NEW_LIST:
+  case opCode::PRIMITIVE:
+  case opCode::GET_UPVAL:
+  case opCode::CLOSURE:
+    defs.set(ins.regA());
+    break;
+  case opCode::MOV:
+    defs.set(ins.regA());
+    uses.set(ins.regD());
+    break;
+  case opCode::GLOBAL_SET:
+  case opCode::JMPF:
+  case opCode::RETURN:
+    uses.set(ins.regA());
+    break;
+  case opCode::CALL:
+    defs.set(ins.regA());
+    [[fallthrough]];
+  case opCode::TAILCALL: {
+    // The compiler keeps calls within the registers, but the set mustn't
+    // overflow if one ever isn't.
+    auto last = std::min(ins.regA() + (size_t)ins.regD(), MAX_REG);
+    for (size_t r = ins.regA(); r <= last; r++) {
+      uses.set(r);
+    }
+    break;
+  }
+  case opCode::ADD:
+  case opCode::SUB:
+  case opCode::MUL:
+  case opCode::DIV:
+  case opCode::LT:
+  case opCode::LE:
+  case opCode::EQ:
+    uses.set(ins.regC());
+    [[fallthrough]];
+  case opCode::ADDK:
+  case opCode::SUBK:
+  case opCode::MULK:
+  case opCode::DIVK:
+  case opCode::LTK:
+  case opCode::LEK:
+  case opCode::GTK:
+  case opCode::GEK:
+  case opCode::EQK:
+    defs.set(ins.regA());
+    uses.set(ins.regB());
+    break;
+  case opCode::CLOSE:
+  case opCode::JMP:
+    break;
+  }
+}
+
+// Registers captured by a closure may be read through the upvalue at any
+// later call, so they are treated as always live.
+static RegSet capturedRegisters(const Chunk &chunk) {
+  RegSet captured;
+  for (auto &ins : chunk.code) {
+    if (ins.op() != opCode::CLOSURE) {
+      continue;
+    }
+    auto proto = chunk.constants[ins.regD()].as<MALProto>();
+    assert(proto);
+    for (auto &uv : proto->chunk->upvalues) {
+      if (uv.inStack) {
+        captured.set(uv.index);
+      }
+    }
+  }
+  return captured;
+}
+
+// Registers that may be read after each instruction. Jumps only go forwards,
+// so a single backwards pass is exact.
+static std::vector<RegSet> liveOut(const Chunk &chunk) {
+  auto n = chunk.code.size();
+  std::vector<RegSet> in(n + 1);
+  std::vector<RegSet> out(n);
+  for (size_t i = n; i-- > 0;) {
+    auto &ins = chunk.code[i];
+    if (fallsThrough(ins.op())) {
+      out[i] = in[i + 1];
+    }
+    if (isJump(ins.op())) {
+      auto t = jumpTarget(ins, i);
+      assert(t > i && t <= n);
+      out[i] |= in[t];
+    }
+    RegSet uses, defs;
+    usesAndDefs(ins, uses, defs);
+    in[i] = (out[i] & ~defs) | uses;
+  }
+  return out;
+}
+
+// Drops the instructions marked in removed, fixing up jumps around them.
+static void compact(Chunk &chunk, const std::vector<bool> &removed) {
+  auto n = chunk.code.size();
+  std::vector<size_t> newIndex(n + 1);
+  size_t kept = 0;
+  for (size_t i = 0; i < n; i++) {
+    newIndex[i] = kept;
+    kept += !removed[i];
+  }
+  newIndex[n] = kept;
+
+  size_t out = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (removed[i]) {
+      continue;
+    }
+    auto ins = chunk.code[i];
+    if (isJump(ins.op())) {
+      auto offset = newIndex[jumpTarget(ins, i)] - newIndex[i] - 1;
+      ins.setD((uint16_t)offset);
+    }
+    chunk.code[out++] = ins;
+  }
+  chunk.code.resize(out);
+
+  // Runs that lost all their instructions are dropped, and neighbours left
+  // with the same line merged.
+  std::vector<LineInfo> lines;
+  for (size_t i = 0; i < chunk.lines.size(); i++) {
+    auto pc = (uint32_t)newIndex[chunk.lines[i].pc];
+    auto next = i + 1 < chunk.lines.size() ? newIndex[chunk.lines[i + 1].pc]
+                                           : kept;
+    if (pc == next) {
+      continue;
+    }
+    if (lines.empty() || lines.back().line != chunk.lines[i].line) {
+      lines.push_back({pc, chunk.lines[i].line});
+    }
+  }
+  chunk.lines.swap(lines);
+}
+
+static bool removeUnreachable(const Chunk &chunk, std::vector<bool> &removed) {
+  auto n = chunk.code.size();
+  std::vector<bool> reachable(n + 1, false);
+  reachable[0] = true;
+  bool changed = false;
+  for (size_t i = 0; i < n; i++) {
+    auto &ins = chunk.code[i];
+    if (!reachable[i]) {
+      removed[i] = true;
+      changed = true;
+      continue;
+    }
+    if (fallsThrough(ins.op())) {
+      reachable[i + 1] = true;
+    }
+    if (isJump(ins.op())) {
+      reachable[jumpTarget(ins, i)] = true;
+    }
+  }
+  return changed;
+}
+
+static bool removeDeadWrites(const Chunk &chunk, const RegSet &captured,
+                             std::vector<bool> &removed) {
+  auto live = liveOut(chunk);
+  bool changed = false;
+  for (size_t i = 0; i < chunk.code.size(); i++) {
+    auto &ins = chunk.code[i];
+    auto a = ins.regA();
+    bool dead = onlyWritesA(ins.op()) && !captured[a] && !live[i][a];
+    bool selfMove = ins.op() == opCode::MOV && a == ins.regD();
+    bool emptyJump = ins.op() == opCode::JMP && ins.regSD() == 0;
+    if (dead || selfMove || emptyJump) {
+      removed[i] = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+// Rewrites "R[a] = x; MOV c a" to "R[c] = x" when a isn't read afterwards.
+static bool collapseMoves(Chunk &chunk, const RegSet &captured,
+                          std::vector<bool> &removed) {
+  auto n = chunk.code.size();
+  std::vector<bool> isTarget(n + 1, false);
+  for (size_t i = 0; i < n; i++) {
+    if (isJump(chunk.code[i].op())) {
+      isTarget[jumpTarget(chunk.code[i], i)] = true;
+    }
+  }
+
+  auto live = liveOut(chunk);
+  bool changed = false;
+  for (size_t i = 1; i < n; i++) {
+    auto &mov = chunk.code[i];
+    auto &prev = chunk.code[i - 1];
+    if (mov.op() != opCode::MOV || isTarget[i] || removed[i - 1]) {
+      continue;
+    }
+    auto a = (reg)mov.regD();
+    if (!retargetable(prev.op()) || prev.regA() != a || captured[a] ||
+        live[i][a]) {
+      continue;
+    }
+    prev.regA() = mov.regA();
+    removed[i] = true;
+    changed = true;
+  }
+  return changed;
+}
+
+void optimizeChunk(Chunk &chunk) {
+  auto captured = capturedRegisters(chunk);
+  for (bool changed = true; changed;) {
+    std::vector<bool> removed(chunk.code.size(), false);
+    changed = removeUnreachable(chunk, removed);
+    if (!changed) {
+      changed = collapseMoves(chunk, captured, removed);
+    }
+    if (!changed) {
+      changed = removeDeadWrites(chunk, captured, removed);
+    }
+    compact(chunk, removed);
+  }
+}
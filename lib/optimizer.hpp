@@ -0,0 +1,8 @@
+#pragma once
+
+#include "chunk.hpp"
+
+// Peephole pass over a finished chunk. Removes unreachable code and writes to
+// registers that are never read, and folds a MOV into the instruction that
+// produced its source.
+void optimizeChunk(Chunk &chunk);
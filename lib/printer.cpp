@@ -0,0 +1,103 @@
+#include "printer.hpp"
+
+#include <charconv>
+#include <cstdio>
+
+void Printer::operator()(MALNil) { out += "nil"; }
+
+void Printer::operator()(bool b) { out += b ? "true" : "false"; }
+
+void Printer::operator()(int64_t n) {
+  char buf[24];
+  auto res = std::to_chars(buf, buf + sizeof(buf), n);
+  out.append(buf, res.ptr);
+}
+
+void Printer::operator()(double x) {
+  // The same format as std::to_string, without its temporary string. Large
+  // doubles have up to 309 digits before the point.
+  char buf[320];
+  auto len = std::snprintf(buf, sizeof(buf), "%f", x);
+  out.append(buf, (size_t)len);
+}
+
+template <typename T>
+void Printer::printSeq(const T &seq, char open, char close) {
+  out += open;
+  bool first = true;
+  for (auto &m : seq) {
+    if (!first) {
+      out += ' ';
+    }
+    first = false;
+    print(m);
+  }
+  out += close;
+}
+
+void Printer::operator()(const MALList *list) { printSeq(*list, '(', ')'); }
+
+void Printer::operator()(const MALVector *vec) { printSeq(*vec, '[', ']'); }
+
+void Printer::operator()(const MALVecNode *) { out += "#<vecnode>"; }
+
+void Printer::operator()(const MALMap *map) {
+  out += '{';
+  bool first = true;
+  map->forEach([&](MALType key, MALType value) {
+    if (!first) {
+      out += ' ';
+    }
+    first = false;
+    print(key);
+    out += ' ';
+    print(value);
+  });
+  out += '}';
+}
+
+void Printer::operator()(const MALMapNode *) { out += "#<mapnode>"; }
+
+void Printer::operator()(const MALSymbol *sym) { out += sym->symbol; }
+
+void Printer::operator()(const MALKeyword *kw) { out += kw->keyword; }
+
+void Printer::operator()(const MALString *str) {
+  if (!readably) {
+    out += str->str;
+    return;
+  }
+  out += '"';
+  for (auto c : str->str) {
+    switch (c) {
+    case '"':
+      out += "\\\"";
+      break;
+    case '\\':
+      out += "\\\\";
+      break;
+    case '\n':
+      out += "\\n";
+      break;
+    case '\r':
+      out += "\\r";
+      break;
+    case '\t':
+      out += "\\t";
+      break;
+    default:
+      out += c;
+    }
+  }
+  out += '"';
+}
+
+void Printer::operator()(const MALCFunc *fn) { out += fn->name; }
+
+void Printer::operator()(const MALProto *) { out += "#<proto>"; }
+
+void Printer::operator()(const MALClosure *) { out += "#<function>"; }
+
+void Printer::operator()(const MALUpvalue *) { out += "#<upvalue>"; }
+
+void Printer::operator()(const MALInt *n) { (*this)(n->value); }
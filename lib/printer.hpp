@@ -0,0 +1,42 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <cstdint>
+#include <string>
+
+// Appends the printed form of values to out. Nested values are printed by
+// recursing on references into the same buffer, so printing allocates only
+// when out has to grow, and a caller that reuses out doesn't allocate at all.
+//
+// Printing readably quotes strings and escapes their contents so that the
+// reader reads them back as the same string.
+struct Printer {
+  Printer(std::string &out, bool readably) : out(out), readably(readably){};
+
+  inline void print(MALType m) { visit(*this, m); };
+
+  void operator()(MALNil);
+  void operator()(bool b);
+  void operator()(int64_t n);
+  void operator()(double x);
+  void operator()(const MALList *list);
+  void operator()(const MALVector *vec);
+  void operator()(const MALVecNode *);
+  void operator()(const MALMap *map);
+  void operator()(const MALMapNode *);
+  void operator()(const MALSymbol *sym);
+  void operator()(const MALKeyword *kw);
+  void operator()(const MALString *str);
+  void operator()(const MALCFunc *fn);
+  void operator()(const MALProto *);
+  void operator()(const MALClosure *);
+  void operator()(const MALUpvalue *);
+  void operator()(const MALInt *n);
+
+private:
+  template <typename T> void printSeq(const T &seq, char open, char close);
+
+  std::string &out;
+  bool readably;
+};
@@ -0,0 +1,133 @@
+#include "profiler.hpp"
+
+#include "chunk.hpp"
+#include "image.hpp"
+#include "state.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <signal.h>
+#include <sys/time.h>
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "the SIGPROF handler needs a lock free counter");
+
+std::atomic<uint32_t> Profiler::ticks{0};
+
+// The handler that was installed before the running profiler's, if one is.
+static struct sigaction previous;
+static bool profiling = false;
+
+static void onTick(int) {
+  Profiler::ticks.fetch_add(1, std::memory_order_relaxed);
+}
+
+Profiler::~Profiler() { stop(); }
+
+bool Profiler::start(unsigned hz, std::shared_ptr<MALError> &error) {
+  if (profiling) {
+    error = std::make_shared<MALError>("A profiler is already running");
+    return false;
+  }
+  if (hz == 0 || hz > 1000000) {
+    error = std::make_shared<MALError>("Bad profiling rate");
+    return false;
+  }
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = onTick;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  if (sigaction(SIGPROF, &action, &previous) != 0) {
+    error = std::make_shared<MALError>(std::string("sigaction: ") +
+                                       std::strerror(errno));
+    return false;
+  }
+  struct itimerval timer;
+  auto usec = 1000000 / hz;
+  timer.it_interval.tv_sec = (time_t)(usec / 1000000);
+  timer.it_interval.tv_usec = (suseconds_t)(usec % 1000000);
+  timer.it_value = timer.it_interval;
+  if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+    error = std::make_shared<MALError>(std::string("setitimer: ") +
+                                       std::strerror(errno));
+    sigaction(SIGPROF, &previous, nullptr);
+    return false;
+  }
+  ticks.store(0, std::memory_order_relaxed);
+  profiling = running = true;
+  return true;
+}
+
+void Profiler::stop() {
+  if (!running) {
+    return;
+  }
+  struct itimerval timer;
+  std::memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, nullptr);
+  sigaction(SIGPROF, &previous, nullptr);
+  ticks.store(0, std::memory_order_relaxed);
+  profiling = running = false;
+}
+
+// Names a frame after its function, and where that was defined. Frames that
+// run a top level form are named after the form instead.
+void Profiler::appendFrame(const CallFrame &frame) {
+  if (auto fn = frame.fn.as<MALCFunc>()) {
+    stack += fn->name;
+    return;
+  }
+  auto cl = frame.fn.as<MALClosure>();
+  if (!cl) {
+    stack += "?";
+    return;
+  }
+  auto &chunk = *cl->proto->chunk;
+  if (!frame.ip) {
+    stack += "top-level";
+  } else if (!chunk.name.empty()) {
+    stack += chunk.name;
+  } else {
+    stack += "fn*";
+  }
+  stack += " (";
+  if (chunk.file) {
+    stack += *chunk.file;
+    stack += ':';
+  }
+  stack += std::to_string(chunk.line);
+  stack += ')';
+}
+
+void Profiler::sample(const std::vector<CallFrame> &frames) {
+  if (!running) {
+    return;
+  }
+  auto n = ticks.exchange(0, std::memory_order_relaxed);
+  if (n == 0 || frames.empty()) {
+    return;
+  }
+  stack.clear();
+  for (auto &frame : frames) {
+    if (!stack.empty()) {
+      stack += ';';
+    }
+    appendFrame(frame);
+  }
+  samples[stack] += n;
+}
+
+bool Profiler::write(const std::string &path,
+                     std::shared_ptr<MALError> &error) const {
+  std::string out;
+  for (auto &[stack, count] : samples) {
+    out += stack;
+    out += ' ';
+    out += std::to_string(count);
+    out += '\n';
+  }
+  return writeFileAtomically(path, out, error);
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "types.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct CallFrame;
+
+// Samples the VM's call stack on a CPU time timer, to find the functions a
+// program spends its time in.
+//
+// The SIGPROF handler only counts ticks. The VM checks for them at calls and
+// returns, where its frames are consistent, and takes the sample itself, so
+// the handler never looks at anything the VM may be in the middle of
+// changing. A sample is charged every tick since the last one.
+//
+// The timer and the handler are process wide, so only one profiler can run
+// at a time.
+struct Profiler {
+  Profiler() = default;
+  ~Profiler();
+
+  Profiler(const Profiler &) = delete;
+  Profiler &operator=(const Profiler &) = delete;
+
+  // Starts sampling hz times a second of CPU time.
+  bool start(unsigned hz, std::shared_ptr<MALError> &error);
+  void stop();
+
+  // Charges the pending ticks to the stack of frames.
+  void sample(const std::vector<CallFrame> &frames);
+
+  // Writes the samples as folded stacks: one line per distinct stack, with
+  // the frames outermost first separated by semicolons, then the count. That
+  // is what flamegraph.pl and most other flame graph tools read.
+  bool write(const std::string &path, std::shared_ptr<MALError> &error) const;
+
+  // Ticks not yet charged to a sample. Nonzero only while a profiler runs.
+  static std::atomic<uint32_t> ticks;
+
+private:
+  void appendFrame(const CallFrame &frame);
+
+  bool running = false;
+  std::string stack; // Scratch space for building a sample's stack.
+  std::unordered_map<std::string, uint64_t> samples;
+};
@@ -1,33 +1,71 @@
+#include "reader.hpp"
 #include "state.hpp"
 
+#include "arena.hpp"
+#include "heap.hpp"
 #include "token.hpp"
 #include "types.hpp"
 
+#include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <cerrno>
+#include <charconv>
 #include <cstring>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 Token Scanner::scan(void) {
   auto ret = peek();
   current += ret.length;
+  peeked = false;
   return ret;
 }
 
+Token Scanner::peek(void) {
+  if (!peeked) {
+    lookahead = next();
+    peeked = true;
+  }
+  return lookahead;
+}
+
 static Token specialIdentifier(const char *current, int len) {
   if (len == 3 && strncmp("nil", current, (size_t)len) == 0) {
     return Token{TokenType::NIL, current, len};
   }
+  if (len == 4 && strncmp("true", current, (size_t)len) == 0) {
+    return Token{TokenType::TRUE, current, len};
+  }
+  if (len == 5 && strncmp("false", current, (size_t)len) == 0) {
+    return Token{TokenType::FALSE, current, len};
+  }
   return Token{TokenType::Identifier, current, len};
 }
 
-Token Scanner::peek(void) {
-  while (*current && (std::isspace(*current) || *current == ','))
-    current++;
+Token Scanner::next(void) {
+  // Skip whitespace and comments, which run to the end of the line.
+  current = runs.skipSpace(current);
+  while (current != end && *current == ';') {
+    auto nl = (const char *)std::memchr(current, '\n', (size_t)(end - current));
+    current = runs.skipSpace(nl ? nl + 1 : end);
+  }
 
+  if (current == end) {
+    hitEnd = true;
+    return Token{TokenType::EOFToken, nullptr, 0};
+  }
   switch (*current) {
   case 0:
+    hitEnd = true;
     return Token{TokenType::EOFToken, nullptr, 0};
   case '(':
     return Token{TokenType::LeftParen, current, 1};
@@ -53,221 +91,644 @@ Token Scanner::peek(void) {
     return Token{TokenType::QuasiQuote, current, 1};
   case '\'':
     return Token{TokenType::Quote, current, 1};
-  case ';': {
-    // This line is a comment
-    int len = 1;
-    while (current[len] && current[len] != '\n')
-      len++;
-    return Token{TokenType::None, current, len + 1};
-  }
   case '"': {
-    int len = 1;
+    auto p = current + 1;
     while (true) {
-      switch (current[len]) {
+      p = runs.stringEnd(p);
+      switch (*p) {
       case 0:
+        hitEnd = true;
         return Token{TokenType::EOFToken, nullptr, 0};
       case '"':
-        len++;
-        return Token{TokenType::String, current, len};
-      case '\\':
-        len++;
-        switch (current[len]) {
+        p++;
+        return Token{TokenType::String, current, (int)(p - current)};
+      default:
+        // A backslash, which must start one of the escapes we know.
+        p++;
+        switch (*p) {
         case 0:
+          hitEnd = true;
           return Token{TokenType::EOFToken, nullptr, 0};
         case '"':
         case '\\':
         case 'n':
         case 'r':
         case 't':
-          len++;
+          p++;
           break;
         default:
           return Token{TokenType::BadEscape, nullptr, 0};
         }
-        break;
-      default:
-        len++;
-      }
-    }
-  }
-  default: {
-    int len = 1;
-    while (true) {
-      switch (current[len]) {
-      case 0:
-      case '(':
-      case ')':
-      case '{':
-      case '}':
-      case '[':
-      case ']':
-      case '\'':
-      case '"':
-      case '`':
-      case ',':
-      case ';':
-        return specialIdentifier(current, len);
-      default:
-        if (std::isspace(current[len]))
-          return specialIdentifier(current, len);
-        len++;
       }
     }
   }
+  default:
+    return specialIdentifier(current,
+                             (int)(runs.atomEnd(current + 1) - current));
   }
 }
 
-static MALType read_form(Scanner &scanner);
+// Atoms are interned on the heap, looked up by a view of their token so that
+// known names aren't copied. Containers are built with alloc, from elements
+// collected on items: in the arena for code, which is only needed until it is
+// compiled, and on the heap for data.
+//
+// Code also has the line of each container recorded in lines, for the
+// compiler. Lines are counted as the reader goes, from where it started.
+template <typename A> struct Reader {
+  Heap &heap;
+  A &alloc;
+  std::vector<MALType> items;
+  std::string text;    // Scratch space for unescaping strings.
+  SourceLines *lines;  // Null when reading data.
+  const char *counted; // The newlines before this are counted in line.
+  uint32_t line;
+
+  // The line of p, which mustn't be before any p asked about already.
+  uint32_t lineAt(const char *p) {
+    if (lines) {
+      line += (uint32_t)std::count(counted, p, '\n');
+      counted = p;
+    }
+    return line;
+  };
+
+  MALType locate(MALType m, uint32_t at) {
+    if (lines && m.isObj()) {
+      lines->push_back({m.asObj(), at});
+    }
+    return m;
+  };
+};
 
-template <typename T, TokenType closer>
-static inline MALType read_container(std::shared_ptr<T> list,
-                                     Scanner &scanner) {
+template <typename A>
+static MALType read_form(Scanner &scanner, Reader<A> &reader);
+
+template <TokenType closer, typename A>
+static inline bool read_container(Scanner &scanner, Reader<A> &reader) {
   for (auto tok = scanner.peek();
        tok.type != closer && tok.type != TokenType::EOFToken;
        tok = scanner.peek()) {
-    auto m = read_form(scanner);
+    auto m = read_form(scanner, reader);
     if (scanner.error)
-      return m;
-    list->data.push_back(m);
+      return false;
+    reader.items.push_back(m);
   }
   if (scanner.peek().type == TokenType::EOFToken) {
     scanner.error = std::make_shared<MALError>("EOF");
-    return MALType();
+    return false;
   }
   scanner.scan(); // Discard the close paren.
-  return MALType{list};
+  return true;
 }
 
-static MALType read_list(Scanner &scanner) {
-  return read_container<MALList, TokenType::RightParen>(
-      std::make_shared<MALList>(), scanner);
+// Builds a T from the items pushed since start, and pops them.
+template <typename T, typename A>
+static MALType build(Reader<A> &reader, size_t start) {
+  auto &items = reader.items;
+  auto ret = T::from(reader.alloc, items.data() + start,
+                     items.data() + items.size());
+  items.resize(start);
+  return MALType{ret};
+}
+
+template <typename A>
+static MALType read_list(Scanner &scanner, Reader<A> &reader) {
+  auto start = reader.items.size();
+  if (!read_container<TokenType::RightParen>(scanner, reader)) {
+    return MALType();
+  }
+  return build<MALList>(reader, start);
 }
 
-static MALType read_vec(Scanner &scanner) {
-  auto list = std::make_shared<MALVector>();
-  return read_container<MALVector, TokenType::RightBracket>(list, scanner);
+template <typename A>
+static MALType read_vec(Scanner &scanner, Reader<A> &reader) {
+  auto start = reader.items.size();
+  if (!read_container<TokenType::RightBracket>(scanner, reader)) {
+    return MALType();
+  }
+  return build<MALVector>(reader, start);
 }
 
-static MALType read_map(Scanner &scanner) {
-  auto list = std::make_shared<MALList>();
-  list->data.push_back(MALType{std::make_shared<MALSymbol>("hash-map")});
-  return read_container<MALList, TokenType::RightBrace>(list, scanner);
+template <typename A>
+static MALType read_map(Scanner &scanner, Reader<A> &reader) {
+  auto start = reader.items.size();
+  reader.items.push_back(MALType{reader.heap.intern("hash-map")});
+  if (!read_container<TokenType::RightBrace>(scanner, reader)) {
+    return MALType();
+  }
+  return build<MALList>(reader, start);
 }
 
-static MALType read_string(Scanner &scanner) {
+template <typename A>
+static MALType read_string(Scanner &scanner, Reader<A> &reader) {
   auto tok = scanner.scan();
   assert(tok.type == TokenType::String);
-  if (tok.length > 1 && tok.start[tok.length - 1] == '"') {
-    return MALType{std::make_shared<MALString>(tok.start, tok.length)};
+  if (tok.length < 2 || tok.start[tok.length - 1] != '"') {
+    scanner.error = std::make_shared<MALError>("EOF");
+    return MALType();
+  }
+  // Strings are immutable and end up as interned constants anyway. The
+  // scanner has already checked the escapes, so most strings, which have
+  // none, are looked up by a view of their token.
+  std::string_view str(tok.start + 1, (size_t)tok.length - 2);
+  auto escape = str.find('\\');
+  if (escape == std::string_view::npos) {
+    return MALType{reader.heap.internString(str)};
+  }
+  auto &text = reader.text;
+  text.assign(str.data(), escape);
+  for (auto i = escape; i < str.size(); i++) {
+    if (str[i] != '\\') {
+      text += str[i];
+      continue;
+    }
+    switch (str[++i]) {
+    case 'n':
+      text += '\n';
+      break;
+    case 'r':
+      text += '\r';
+      break;
+    case 't':
+      text += '\t';
+      break;
+    default:
+      text += str[i];
+    }
   }
-  scanner.error = std::make_shared<MALError>("EOF");
-  return MALType();
+  return MALType{reader.heap.internString(text)};
 }
 
-static MALType read_macro(Scanner &scanner, const std::string &symbol) {
-  scanner.scan(); // pop the '
+template <typename A>
+static MALType read_macro(Scanner &scanner, Reader<A> &reader,
+                          const char *symbol) {
+  auto line = reader.lineAt(scanner.scan().start); // pop the '
 
-  auto list = std::make_shared<MALList>();
-  list->data.push_back(MALType{std::make_shared<MALSymbol>(symbol)});
-  auto m = read_form(scanner);
+  auto m = read_form(scanner, reader);
   if (scanner.error) {
     return m;
   }
-  list->data.push_back(m);
 
-  return MALType{list};
+  auto start = reader.items.size();
+  reader.items.push_back(MALType{reader.heap.intern(symbol)});
+  reader.items.push_back(m);
+  return reader.locate(build<MALList>(reader, start), line);
 }
 
-static MALType read_meta(Scanner &scanner) {
-  scanner.scan(); // Pop off the ^
-
-  auto list = std::make_shared<MALList>();
-  list->data.push_back(MALType{std::make_shared<MALSymbol>("with-meta")});
+template <typename A>
+static MALType read_meta(Scanner &scanner, Reader<A> &reader) {
+  auto line = reader.lineAt(scanner.scan().start); // Pop off the ^
 
-  auto meta = read_form(scanner);
+  auto meta = read_form(scanner, reader);
   if (scanner.error) {
     return meta;
   }
 
-  auto form = read_form(scanner);
+  auto form = read_form(scanner, reader);
   if (scanner.error) {
     return form;
   }
-  list->data.push_back(form);
-  list->data.push_back(meta);
 
-  return MALType{list};
+  auto start = reader.items.size();
+  reader.items.push_back(MALType{reader.heap.intern("with-meta")});
+  reader.items.push_back(form);
+  reader.items.push_back(meta);
+  return reader.locate(build<MALList>(reader, start), line);
 }
 
-static MALType read_atom(Scanner &scanner) {
+// Reads a decimal integer or floating point number that spans [first, last).
+// Integers short enough that they can't overflow are converted as they are
+// checked; anything else goes through std::from_chars. Integers too large for
+// 64 bits are read as doubles.
+static bool readNumber(Heap &heap, const char *first, const char *last,
+                       MALType &out) {
+  constexpr ptrdiff_t MAX_SAFE_DIGITS = 18;
+  auto digits = first + (*first == '-');
+  uint64_t n = 0;
+  auto p = digits;
+  for (; p != last && (unsigned)(*p - '0') < 10; p++) {
+    n = n * 10 + (uint64_t)(*p - '0');
+  }
+  if (p == last) {
+    if (last - digits <= MAX_SAFE_DIGITS) {
+      out = makeInt(heap, *first == '-' ? -(int64_t)n : (int64_t)n);
+      return true;
+    }
+    int64_t big;
+    if (std::from_chars(first, last, big).ec == std::errc()) {
+      out = makeInt(heap, big);
+      return true;
+    }
+  }
+  double x;
+  auto [end, ec] = std::from_chars(first, last, x);
+  if (ec != std::errc() || end != last) {
+    return false;
+  }
+  out = MALType{x};
+  return true;
+}
+
+template <typename A>
+static MALType read_atom(Scanner &scanner, Reader<A> &reader) {
   auto tok = scanner.scan();
   if (isdigit(tok.start[0]) ||
       (tok.start[0] == '-' && tok.length > 1 && isdigit(tok.start[1]))) {
-    size_t pos = 0;
-    auto n = std::stoi(tok.start, &pos);
-    assert(pos <= (size_t)tok.length);
-    if (pos == (size_t)tok.length) {
-      return MALType{n};
-    }
-    auto x = std::stod(tok.start, &pos);
-    assert(pos <= (size_t)tok.length);
-    if (pos == (size_t)tok.length) {
-      return MALType{x};
+    MALType n;
+    if (!readNumber(reader.heap, tok.start, tok.start + tok.length, n)) {
+      scanner.error = std::make_shared<MALError>("Bad number");
     }
-    scanner.error = std::make_shared<MALError>("Bad number");
-    return MALType();
+    return n;
   }
   if (tok.start[0] == ':') {
-    return MALType{std::make_shared<MALKeyword>(tok.start, tok.length)};
+    return MALType{reader.heap.internKeyword({tok.start, (size_t)tok.length})};
   }
-  return MALType{std::make_shared<MALSymbol>(tok.start, tok.length)};
+  return MALType{reader.heap.intern({tok.start, (size_t)tok.length})};
 }
 
-static MALType read_form(Scanner &scanner) {
+template <typename A>
+static MALType read_form(Scanner &scanner, Reader<A> &reader) {
   auto tok = scanner.peek();
   switch (tok.type) {
-  case TokenType::LeftParen:
-    scanner.scan(); // pop the Paren off the scanner.
-    return read_list(scanner);
-  case TokenType::LeftBracket:
-    scanner.scan(); // pop the Bracket off the scanner.
-    return read_vec(scanner);
-  case TokenType::LeftBrace:
-    scanner.scan(); // pop the Brace off the scanner.
-    return read_map(scanner);
+  case TokenType::LeftParen: {
+    auto line = reader.lineAt(scanner.scan().start); // pop the Paren off.
+    return reader.locate(read_list(scanner, reader), line);
+  }
+  case TokenType::LeftBracket: {
+    auto line = reader.lineAt(scanner.scan().start); // pop the Bracket off.
+    return reader.locate(read_vec(scanner, reader), line);
+  }
+  case TokenType::LeftBrace: {
+    auto line = reader.lineAt(scanner.scan().start); // pop the Brace off.
+    return reader.locate(read_map(scanner, reader), line);
+  }
   case TokenType::EOFToken:
     scanner.error = std::make_shared<MALError>("EOF");
     return MALType();
+  case TokenType::BadEscape:
+    scanner.error = std::make_shared<MALError>("Bad escape in string");
+    return MALType();
   case TokenType::String:
-    return read_string(scanner);
+    return read_string(scanner, reader);
   case TokenType::Quote:
-    return read_macro(scanner, "quote");
+    return read_macro(scanner, reader, "quote");
   case TokenType::QuasiQuote:
-    return read_macro(scanner, "quasiquote");
+    return read_macro(scanner, reader, "quasiquote");
   case TokenType::Unquote:
-    return read_macro(scanner, "unquote");
+    return read_macro(scanner, reader, "unquote");
   case TokenType::SpliceUnquote:
-    return read_macro(scanner, "splice-unquote");
+    return read_macro(scanner, reader, "splice-unquote");
   case TokenType::Deref:
-    return read_macro(scanner, "deref");
+    return read_macro(scanner, reader, "deref");
   case TokenType::Meta:
-    return read_meta(scanner);
+    return read_meta(scanner, reader);
   case TokenType::NIL:
     scanner.scan();
     return MALType{};
+  case TokenType::TRUE:
+    scanner.scan();
+    return MALType{true};
+  case TokenType::FALSE:
+    scanner.scan();
+    return MALType{false};
   default:
-    return read_atom(scanner);
+    return read_atom(scanner, reader);
   }
   return MALType{};
 }
 
 bool MALState::read_str(std::string &str, int reg) {
+  if (!state->ensureStack((size_t)reg + 1)) {
+    return false;
+  }
+  // Only the last form read is kept, so repeated reads don't grow the arena.
+  state->resetArena();
   auto scanner = Scanner(str);
-  auto ret = read_form(scanner);
+  auto reader = Reader<Arena>{
+      state->heap, state->arena, {}, {}, &state->lines, str.data(), 1};
+  auto ret = read_form(scanner, reader);
   if (scanner.error) {
     state->error = scanner.error;
     return false;
   }
   state->stack[(size_t)reg] = ret;
+  if (ret.isObj()) {
+    state->unread = ret.asObj();
+    state->unreadReg = (size_t)reg;
+  }
+  return true;
+}
+
+FormReader::FormReader(const std::string &text)
+    : begin(text.data()), end(text.data() + text.size()), line(1), fd(-1),
+      exhausted(true), mapping(nullptr), mappingSize(0) {}
+
+FormReader::FormReader(int fd)
+    : begin(nullptr), end(nullptr), line(1), fd(fd), exhausted(false),
+      mapping(nullptr), mappingSize(0) {
+  begin = end = buffer.data();
+}
+
+FormReader::FormReader(const char *data, size_t size, void *mapping)
+    : begin(data), end(data + size), line(1), fd(-1), exhausted(true),
+      mapping(mapping), mappingSize(size) {}
+
+FormReader::~FormReader() {
+  if (mapping) {
+    munmap(mapping, mappingSize);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+std::unique_ptr<FormReader>
+FormReader::open(const std::string &path, std::shared_ptr<MALError> &error) {
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    error = std::make_shared<MALError>(path + ": " + std::strerror(errno));
+    return nullptr;
+  }
+  // A mapping reads as zeros past the end of the file, which gives the
+  // scanner its terminating NUL unless the file fills its last page.
+  struct stat st;
+  auto pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+      (size_t)st.st_size % pageSize != 0) {
+    auto size = (size_t)st.st_size;
+    auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      close(fd);
+      madvise(data, size, MADV_SEQUENTIAL);
+      auto in = std::unique_ptr<FormReader>(
+          new FormReader(static_cast<const char *>(data), size, data));
+      in->file = std::make_shared<const std::string>(path);
+      return in;
+    }
+  }
+  auto in = std::make_unique<FormReader>(fd);
+  in->file = std::make_shared<const std::string>(path);
+  return in;
+}
+
+// Drops the input that has been read and appends the next chunk of fd.
+// Returns false if reading failed.
+bool FormReader::fill() {
+  auto unread = (size_t)(end - begin);
+  buffer.erase(0, (size_t)(begin - buffer.data()));
+  // Reading at least as much again as is buffered means a form that spans
+  // many chunks is only rescanned a logarithmic number of times.
+  auto want = std::max(CHUNK_SIZE, unread);
+  buffer.resize(unread + want);
+  size_t got = 0;
+  while (got < want) {
+    auto n = ::read(fd, buffer.data() + unread + got, want - got);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      error = std::make_shared<MALError>(std::string("Read failed: ") +
+                                         std::strerror(errno));
+      exhausted = true;
+      break;
+    }
+    if (n == 0) {
+      exhausted = true;
+      break;
+    }
+    got += (size_t)n;
+  }
+  buffer.resize(unread + got);
+  begin = buffer.data();
+  end = begin + buffer.size();
+  return !error;
+}
+
+bool FormReader::next(Heap &heap, Arena &arena, SourceLines &lines,
+                      MALType &form) {
+  while (true) {
+    auto scanner = Scanner(begin, end);
+    auto reader = Reader<Arena>{heap, arena, {}, {}, &lines, begin, line};
+    if (scanner.peek().type == TokenType::EOFToken &&
+        scanner.position() == end) {
+      // Only whitespace and comments are left. They stay buffered, since a
+      // comment may carry on into the next chunk.
+      if (exhausted || !fill()) {
+        return false;
+      }
+      continue;
+    }
+    form = read_form(scanner, reader);
+    // A form that runs into the end of the buffer may carry on past it, so it
+    // is read again once there is more input.
+    if (!exhausted && (scanner.hitEnd || scanner.position() == end)) {
+      if (!fill()) {
+        return false;
+      }
+      continue;
+    }
+    if (scanner.error) {
+      error = scanner.error;
+      return false;
+    }
+    line += (uint32_t)std::count(begin, scanner.position(), '\n');
+    begin = scanner.position();
+    return true;
+  }
+}
+
+// Returns where to split [begin, end) into parts of about step bytes. Each
+// split is at the start of a top level form, found by tracking bracket depth
+// and skipping strings and comments the way the Scanner does. A reader macro
+// is never split from the forms it applies to.
+static std::vector<const char *> splitForms(const char *begin, const char *end,
+                                            size_t step) {
+  RunFinder runs(end);
+  std::vector<const char *> splits;
+  // The number of forms each pending top level reader macro still needs.
+  std::vector<int> owed;
+  size_t depth = 0;
+  auto next = begin + step;
+  for (auto p = begin;;) {
+    p = runs.skipSpace(p);
+    if (p == end || *p == 0) {
+      return splits;
+    }
+    if (*p == ';') {
+      auto nl = (const char *)std::memchr(p, '\n', (size_t)(end - p));
+      p = nl ? nl + 1 : end;
+      continue;
+    }
+    if (p >= next && depth == 0 && owed.empty()) {
+      splits.push_back(p);
+      next = p + step;
+    }
+    bool formEnded = false;
+    switch (*p) {
+    case '(':
+    case '[':
+    case '{':
+      depth++;
+      p++;
+      continue;
+    case ')':
+    case ']':
+    case '}':
+      p++;
+      if (depth == 0) {
+        continue; // Left for the reader to complain about.
+      }
+      formEnded = --depth == 0;
+      break;
+    case '"':
+      for (p = runs.stringEnd(p + 1); *p == '\\' && p + 1 < end;) {
+        p = runs.stringEnd(p + 2);
+      }
+      p += p < end;
+      formEnded = depth == 0;
+      break;
+    case '~':
+      p += p[1] == '@';
+      [[fallthrough]];
+    case '\'':
+    case '`':
+    case '@':
+    case '^':
+      if (depth == 0) {
+        owed.push_back(*p == '^' ? 2 : 1);
+      }
+      p++;
+      continue;
+    default:
+      p = runs.atomEnd(p + 1);
+      formEnded = depth == 0;
+      break;
+    }
+    // A finished form may complete a macro, which is then a finished form.
+    while (formEnded && !owed.empty() && --owed.back() == 0) {
+      owed.pop_back();
+    }
+  }
+}
+
+// Reads the forms in [begin, end) onto heap.
+static bool readPart(Heap &heap, const char *begin, const char *end,
+                     std::vector<MALType> &forms,
+                     std::shared_ptr<MALError> &error) {
+  auto scanner = Scanner(begin, end);
+  auto reader = Reader<Heap>{heap, heap, {}, {}, nullptr, nullptr, 0};
+  while (scanner.peek().type != TokenType::EOFToken ||
+         scanner.position() != end) {
+    auto form = read_form(scanner, reader);
+    if (scanner.error) {
+      error = scanner.error;
+      return false;
+    }
+    forms.push_back(form);
+  }
+  return true;
+}
+
+// Replaces the atoms in m that forward maps to another heap's copies. Only
+// the containers built by readPart need to be walked; they are not shared.
+static void forwardAtoms(MALType &m, const Heap::Forwarding &forward) {
+  if (!m.isObj()) {
+    return;
+  }
+  auto obj = m.asObj();
+  switch (obj->type) {
+  case ObjType::List:
+    for (auto l = static_cast<MALList *>(obj); l && l->cnt; l = l->rest) {
+      forwardAtoms(l->first, forward);
+    }
+    break;
+  case ObjType::Vector: {
+    auto v = static_cast<MALVector *>(obj);
+    for (auto &e : v->tail) {
+      forwardAtoms(e, forward);
+    }
+    if (v->root) {
+      MALType root{v->root};
+      forwardAtoms(root, forward);
+    }
+    break;
+  }
+  case ObjType::VecNode:
+    for (auto &e : static_cast<MALVecNode *>(obj)->slots) {
+      forwardAtoms(e, forward);
+    }
+    break;
+  default:
+    if (obj->marked) {
+      m = MALType{forward.at(obj)};
+    }
+  }
+}
+
+bool FormReader::readAll(Heap &heap, std::vector<MALType> &forms) {
+  while (!exhausted) {
+    if (!fill()) {
+      return false;
+    }
+  }
+  auto size = (size_t)(end - begin);
+  auto threads = std::thread::hardware_concurrency();
+  std::vector<const char *> splits;
+  if (threads > 1 && size >= 2 * MIN_PART_SIZE) {
+    splits = splitForms(begin, end, std::max(MIN_PART_SIZE, size / threads));
+  }
+
+  // The first part is read straight onto heap, the others on threads of their
+  // own with a heap each.
+  struct Part {
+    Heap heap;
+    std::vector<MALType> forms;
+    std::shared_ptr<MALError> error;
+  };
+  std::vector<Part> parts(splits.size());
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < parts.size(); i++) {
+    auto partEnd = i + 1 < splits.size() ? splits[i + 1] : end;
+    workers.emplace_back([&parts, &splits, i, partEnd] {
+      auto &part = parts[i];
+      readPart(part.heap, splits[i], partEnd, part.forms, part.error);
+    });
+  }
+  auto firstEnd = splits.empty() ? end : splits[0];
+  auto ok = readPart(heap, begin, firstEnd, forms, error);
+  for (auto &t : workers) {
+    t.join();
+  }
+  for (auto &part : parts) {
+    if (ok && part.error) {
+      error = part.error;
+      ok = false;
+    }
+  }
+  if (!ok) {
+    return false;
+  }
+
+  Heap::Forwarding forward;
+  for (auto &part : parts) {
+    heap.shareInterned(part.heap, forward);
+  }
+  workers.clear();
+  for (auto &part : parts) {
+    workers.emplace_back([&part, &forward] {
+      for (auto &m : part.forms) {
+        forwardAtoms(m, forward);
+      }
+    });
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+  for (auto &part : parts) {
+    heap.adopt(part.heap);
+    forms.insert(forms.end(), part.forms.begin(), part.forms.end());
+  }
+  begin = end;
   return true;
 }
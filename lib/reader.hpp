@@ -0,0 +1,62 @@
+#pragma once
+
+#include "chunk.hpp"
+#include "types.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct Arena;
+struct Heap;
+
+// Reads the top level forms of a program one at a time. Regular files are
+// mapped; anything else is read through a buffer that only has to hold the
+// form being read, so pipes and large files don't need to fit in memory.
+struct FormReader {
+  // Reads text, which must outlive the reader.
+  explicit FormReader(const std::string &text);
+  // Reads fd to its end. The reader closes fd when it is done.
+  explicit FormReader(int fd);
+  ~FormReader();
+
+  FormReader(const FormReader &) = delete;
+  FormReader &operator=(const FormReader &) = delete;
+
+  // Opens path, or returns nullptr and sets error.
+  static std::unique_ptr<FormReader> open(const std::string &path,
+                                          std::shared_ptr<MALError> &error);
+
+  // Reads the next form, building it in arena and recording the line of its
+  // lists in lines. Returns false at the end of the input, or on failure with
+  // error set.
+  bool next(Heap &heap, Arena &arena, SourceLines &lines, MALType &form);
+
+  // Reads all the remaining forms onto heap. The rest of the input is
+  // buffered, and a large input is split at form boundaries and read on
+  // several threads.
+  bool readAll(Heap &heap, std::vector<MALType> &forms);
+
+  std::shared_ptr<MALError> error;
+  // The path the input was opened from, if it was.
+  std::shared_ptr<const std::string> file;
+
+private:
+  FormReader(const char *data, size_t size, void *mapping);
+
+  bool fill();
+
+  static constexpr size_t CHUNK_SIZE = 64 * 1024;
+  // readAll doesn't give a thread less than this many bytes to read.
+  static constexpr size_t MIN_PART_SIZE = 1024 * 1024;
+
+  const char *begin; // The unread input. *end is always a NUL.
+  const char *end;
+  uint32_t line; // The line begin is on.
+  std::string buffer; // Input read from fd.
+  int fd;
+  bool exhausted; // Whether [begin, end) runs to the end of the input.
+  void *mapping;
+  size_t mappingSize;
+};
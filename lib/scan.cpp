@@ -0,0 +1,39 @@
+#include "scan.hpp"
+
+#include <cstdint>
+
+#if defined(MAL_SIMD_SCANNER) && defined(__SSE2__) &&                         \
+    (defined(__GNUC__) || defined(__clang__))
+#define SSE2_SCANNER
+#include "scan_simd.hpp"
+#endif
+
+void scalarClassify(const char *p, ptrdiff_t n, ScanMasks &m) {
+  auto rest = n < ScanMasks::BLOCK ? ~0ull << n : 0;
+  m = ScanMasks{0, rest, rest};
+  for (ptrdiff_t i = 0; i < n; i++) {
+    auto c = scanClasses[(unsigned char)p[i]];
+    m.space |= (uint64_t)((c & SCAN_SPACE) != 0) << i;
+    m.atomEnd |= (uint64_t)((c & SCAN_ATOM_END) != 0) << i;
+    m.stringEnd |= (uint64_t)((c & SCAN_STRING_END) != 0) << i;
+  }
+}
+
+
+const ScanKernels &scanKernels() {
+  static const ScanKernels *kernels = [] {
+#ifdef SSE2_SCANNER
+    if (__builtin_cpu_supports("avx2")) {
+      if (auto k = avx2ScanKernels()) {
+        return k;
+      }
+    }
+    static const ScanKernels sse2 = {classify<SSE2>};
+    return &sse2;
+#else
+    static const ScanKernels scalar = {nullptr};
+    return &scalar;
+#endif
+  }();
+  return *kernels;
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+enum : uint8_t { SCAN_SPACE = 1, SCAN_ATOM_END = 2, SCAN_STRING_END = 4 };
+
+// The classes each character belongs to, for scanning a byte at a time.
+inline constexpr std::array<uint8_t, 256> scanClasses = [] {
+  std::array<uint8_t, 256> t{};
+  for (unsigned char c : {' ', '\t', '\n', '\v', '\f', '\r', ','}) {
+    t[c] = SCAN_SPACE | SCAN_ATOM_END;
+  }
+  for (unsigned char c : {'\0', '(', ')', '{', '}', '[', ']', '\'', '"', '`',
+                          ';'}) {
+    t[c] |= SCAN_ATOM_END;
+  }
+  for (unsigned char c : {'\0', '"', '\\'}) {
+    t[c] |= SCAN_STRING_END;
+  }
+  return t;
+}();
+
+// The classes of a block of characters, as one bit per character.
+struct ScanMasks {
+  static constexpr ptrdiff_t BLOCK = 64;
+
+  uint64_t space;     // Whitespace and commas.
+  uint64_t atomEnd;   // What ends a symbol, keyword or number.
+  uint64_t stringEnd; // '"' and '\\', which end a run inside a string.
+};
+
+struct ScanKernels {
+  // Classifies the BLOCK characters from p, or is nullptr if there is no
+  // faster way than a byte at a time.
+  void (*classify)(const char *p, ScanMasks &m);
+};
+
+// Classifies the n < BLOCK characters from p. The rest of the block ends
+// every run, as the end of the input does.
+void scalarClassify(const char *p, ptrdiff_t n, ScanMasks &m);
+
+// The fastest kernels the CPU supports, chosen on first use.
+const ScanKernels &scanKernels();
+
+// Kernels built for AVX2, or nullptr if they weren't compiled in.
+const ScanKernels *avx2ScanKernels();
+
+// Finds the ends of runs of characters in [begin, end) for the Scanner. Each
+// lookup returns the first character at or after p that ends the run, or
+// end. A NUL always ends a run, as it ends the input.
+//
+// Most runs are only a few characters long, so rather than look at each run
+// on its own, the input is classified a block at a time and a run's end is
+// found in the block's masks. Without a vector unit to do that, runs are
+// scanned a byte at a time instead.
+class RunFinder {
+public:
+  RunFinder(const char *end)
+      : end(end), base(end), masks{0, ~0ull, ~0ull},
+        kernels(scanKernels()) {}
+
+  // Skips whitespace and commas.
+  inline const char *skipSpace(const char *p) {
+    return find<&ScanMasks::space, SCAN_SPACE, true>(p);
+  };
+  // Finds the end of a symbol, keyword or number.
+  inline const char *atomEnd(const char *p) {
+    return find<&ScanMasks::atomEnd, SCAN_ATOM_END, false>(p);
+  };
+  // Finds the next '"' or '\\' inside a string literal.
+  inline const char *stringEnd(const char *p) {
+    return find<&ScanMasks::stringEnd, SCAN_STRING_END, false>(p);
+  };
+
+private:
+  template <uint64_t ScanMasks::*mask, uint8_t cls, bool in>
+  inline const char *find(const char *p) {
+    // Runs that are over at once, as between a bracket and a token, are
+    // common enough to check for first.
+    if (p == end || ((scanClasses[(unsigned char)*p] & cls) != 0) != in) {
+      return p;
+    }
+    if (!kernels.classify) {
+      while (p != end && ((scanClasses[(unsigned char)*p] & cls) != 0) == in) {
+        p++;
+      }
+      return p;
+    }
+    for (;;) {
+      if ((size_t)(p - base) >= (size_t)ScanMasks::BLOCK) {
+        classify(p);
+      }
+      auto m = in ? ~(masks.*mask) : masks.*mask;
+      if (auto ends = m >> (p - base)) {
+        return p + __builtin_ctzll(ends);
+      }
+      p = base + ScanMasks::BLOCK;
+    }
+  }
+
+  // Classifies the block starting at p. The end of the input is always in a
+  // partial block, so no run goes past it.
+  inline void classify(const char *p) {
+    base = p;
+    if (end - p >= ScanMasks::BLOCK) {
+      kernels.classify(p, masks);
+    } else {
+      scalarClassify(p, end - p, masks);
+    }
+  }
+
+  const char *end;
+  const char *base; // The start of the block masks describes.
+  ScanMasks masks;
+  const ScanKernels &kernels;
+};
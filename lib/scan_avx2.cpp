@@ -0,0 +1,14 @@
+// Built with AVX2 enabled when the SIMD scanner is on; see CMakeLists.txt.
+// Only scanKernels() calls in here, after checking that the CPU has AVX2.
+#include "scan.hpp"
+
+#if defined(MAL_SIMD_SCANNER) && defined(__AVX2__)
+#include "scan_simd.hpp"
+
+const ScanKernels *avx2ScanKernels() {
+  static const ScanKernels avx2 = {classify<AVX2>};
+  return &avx2;
+}
+#else
+const ScanKernels *avx2ScanKernels() { return nullptr; }
+#endif
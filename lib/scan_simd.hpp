@@ -0,0 +1,89 @@
+#pragma once
+
+// SIMD versions of the scan kernels, written once over a small set of vector
+// operations and instantiated for each instruction set in its own translation
+// unit. Everything here has internal linkage, so code built for AVX2 can't be
+// shared with callers built for plain x86-64.
+
+#include "scan.hpp"
+
+#include <immintrin.h>
+
+#include <cstddef>
+#include <cstdint>
+
+namespace {
+
+constexpr char DELIMITERS[] = {'\0', '(', ')', '{', '}', '[',
+                               ']',  '\'', '"', '`', ';'};
+
+struct SSE2 {
+  typedef __m128i V;
+  static constexpr ptrdiff_t WIDTH = 16;
+
+  static inline V load(const char *p) {
+    return _mm_loadu_si128((const __m128i *)p);
+  }
+  static inline V eq(V v, char c) {
+    return _mm_cmpeq_epi8(v, _mm_set1_epi8(c));
+  }
+  static inline V any(V a, V b) { return _mm_or_si128(a, b); }
+  // Bytes in [lo, lo + n].
+  static inline V range(V v, char lo, char n) {
+    auto t = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    return _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(n)), t);
+  }
+  static inline uint32_t mask(V v) { return (uint32_t)_mm_movemask_epi8(v); }
+};
+
+#ifdef __AVX2__
+struct AVX2 {
+  typedef __m256i V;
+  static constexpr ptrdiff_t WIDTH = 32;
+
+  static inline V load(const char *p) {
+    return _mm256_loadu_si256((const __m256i *)p);
+  }
+  static inline V eq(V v, char c) {
+    return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c));
+  }
+  static inline V any(V a, V b) { return _mm256_or_si256(a, b); }
+  static inline V range(V v, char lo, char n) {
+    auto t = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+    return _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(n)), t);
+  }
+  static inline uint32_t mask(V v) {
+    return (uint32_t)_mm256_movemask_epi8(v);
+  }
+};
+#endif
+
+// Whitespace as std::isspace sees it in the C locale, plus commas.
+template <typename S> inline typename S::V spaces(typename S::V v) {
+  return S::any(S::range(v, '\t', '\r' - '\t'),
+                S::any(S::eq(v, ' '), S::eq(v, ',')));
+}
+
+template <typename S> inline typename S::V atomEnds(typename S::V v) {
+  auto m = spaces<S>(v);
+  for (auto c : DELIMITERS) {
+    m = S::any(m, S::eq(v, c));
+  }
+  return m;
+}
+
+template <typename S> inline typename S::V stringEnds(typename S::V v) {
+  return S::any(S::eq(v, '"'), S::any(S::eq(v, '\\'), S::eq(v, '\0')));
+}
+
+template <typename S> void classify(const char *p, ScanMasks &m) {
+  m = ScanMasks{0, 0, 0};
+  for (ptrdiff_t i = 0; i < ScanMasks::BLOCK; i += S::WIDTH) {
+    auto v = S::load(p + i);
+    m.space |= (uint64_t)S::mask(spaces<S>(v)) << i;
+    m.atomEnd |= (uint64_t)S::mask(atomEnds<S>(v)) << i;
+    m.stringEnd |= (uint64_t)S::mask(stringEnds<S>(v)) << i;
+  }
+}
+
+} // namespace
@@ -0,0 +1,667 @@
+#include "state.hpp"
+
+#include "chunk.hpp"
+#include "globals.hpp"
+#include "heap.hpp"
+#include "image.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A snapshot is the object graph reachable from the globals, flattened into
+// a table. After the header come the names of the global slots, then the
+// type of every object, then one record per object, and last the value of
+// every global. Values are stored as their NaN-boxed bits, with each object
+// pointer replaced by one plus the object's index in the table.
+//
+// Atoms come first in the table, so that restoring can allocate everything
+// else empty up front and then fill in each record in one pass, with every
+// reference already pointing at its final object.
+struct SnapshotHeader {
+  static constexpr char MAGIC[4] = {'\x7f', 'M', 'S', 'N'};
+  static constexpr uint16_t VERSION = 3;
+  static constexpr uint16_t BYTE_ORDER_MARK = 0x0102;
+
+  char magic[4];
+  uint16_t version;
+  uint16_t byteOrder;
+  uint32_t globalCount;
+  uint32_t objectCount;
+};
+
+static inline bool isAtom(ObjType type) {
+  return type == ObjType::Symbol || type == ObjType::Keyword ||
+         type == ObjType::String || type == ObjType::Int ||
+         type == ObjType::CFunc;
+}
+
+struct SnapshotWriter {
+  // Numbers every object reachable from roots.
+  void collect(const std::vector<MALType> &roots) {
+    for (auto m : roots) {
+      add(m);
+    }
+    while (!gray.empty()) {
+      auto obj = gray.back();
+      gray.pop_back();
+      addChildren(obj);
+    }
+    std::stable_partition(objects.begin(), objects.end(),
+                          [](MALObject *obj) { return isAtom(obj->type); });
+    for (size_t i = 0; i < objects.size(); i++) {
+      ids[objects[i]] = (uint32_t)i;
+    }
+  }
+
+  template <typename T> void put(T v) {
+    out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+  }
+
+  void putString(const std::string &str) {
+    put((uint32_t)str.size());
+    out += str;
+  }
+
+  void putValue(MALType m) {
+    if (m.isObj()) {
+      auto id = (uintptr_t)ids[m.asObj()] + 1;
+      m = MALType{reinterpret_cast<MALObject *>(id)};
+    }
+    put(m.bits);
+  }
+
+  void putValue(MALObject *obj) {
+    putValue(obj ? MALType{obj} : MALType());
+  }
+
+  void putObject(MALObject *obj);
+
+  std::vector<MALObject *> objects;
+  std::string out;
+
+private:
+  void add(MALType m) {
+    if (m.isObj()) {
+      add(m.asObj());
+    }
+  }
+
+  void add(MALObject *obj) {
+    if (obj && ids.emplace(obj, 0).second) {
+      objects.push_back(obj);
+      gray.push_back(obj);
+    }
+  }
+
+  void addChildren(MALObject *obj);
+
+  std::unordered_map<MALObject *, uint32_t> ids;
+  std::vector<MALObject *> gray;
+};
+
+void SnapshotWriter::addChildren(MALObject *obj) {
+  switch (obj->type) {
+  case ObjType::List: {
+    auto l = static_cast<MALList *>(obj);
+    add(l->first);
+    add(l->rest);
+    break;
+  }
+  case ObjType::Vector: {
+    auto v = static_cast<MALVector *>(obj);
+    add(v->root);
+    for (auto m : v->tail) {
+      add(m);
+    }
+    break;
+  }
+  case ObjType::VecNode:
+    for (auto m : static_cast<MALVecNode *>(obj)->slots) {
+      add(m);
+    }
+    break;
+  case ObjType::Map:
+    add(static_cast<MALMap *>(obj)->root);
+    break;
+  case ObjType::MapNode:
+    for (auto m : static_cast<MALMapNode *>(obj)->slots) {
+      add(m);
+    }
+    break;
+  case ObjType::Proto:
+    for (auto m : static_cast<MALProto *>(obj)->chunk->constants) {
+      add(m);
+    }
+    break;
+  case ObjType::Closure: {
+    auto cl = static_cast<MALClosure *>(obj);
+    add(cl->proto);
+    for (auto uv : cl->upvalues) {
+      add(uv);
+    }
+    break;
+  }
+  case ObjType::Upvalue:
+    add(*static_cast<MALUpvalue *>(obj)->v);
+    break;
+  case ObjType::Symbol:
+  case ObjType::Keyword:
+  case ObjType::String:
+  case ObjType::CFunc:
+  case ObjType::Int:
+    break;
+  }
+}
+
+void SnapshotWriter::putObject(MALObject *obj) {
+  switch (obj->type) {
+  case ObjType::List: {
+    auto l = static_cast<MALList *>(obj);
+    putValue(l->first);
+    putValue(l->rest);
+    put((uint64_t)l->cnt);
+    break;
+  }
+  case ObjType::Vector: {
+    auto v = static_cast<MALVector *>(obj);
+    put((uint64_t)v->cnt);
+    put((uint32_t)v->shift);
+    putValue(v->root);
+    put((uint32_t)v->tail.size());
+    for (auto m : v->tail) {
+      putValue(m);
+    }
+    break;
+  }
+  case ObjType::VecNode:
+    for (auto m : static_cast<MALVecNode *>(obj)->slots) {
+      putValue(m);
+    }
+    break;
+  case ObjType::Map: {
+    auto m = static_cast<MALMap *>(obj);
+    put((uint64_t)m->cnt);
+    putValue(m->root);
+    break;
+  }
+  case ObjType::MapNode: {
+    auto n = static_cast<MALMapNode *>(obj);
+    put(n->datamap);
+    put(n->nodemap);
+    put((uint32_t)n->slots.size());
+    for (auto m : n->slots) {
+      putValue(m);
+    }
+    break;
+  }
+  case ObjType::Symbol:
+    putString(static_cast<MALSymbol *>(obj)->symbol);
+    break;
+  case ObjType::Keyword:
+    putString(static_cast<MALKeyword *>(obj)->keyword);
+    break;
+  case ObjType::String:
+    putString(static_cast<MALString *>(obj)->str);
+    break;
+  case ObjType::Int:
+    put(static_cast<MALInt *>(obj)->value);
+    break;
+  case ObjType::CFunc:
+    putString(static_cast<MALCFunc *>(obj)->name);
+    break;
+  case ObjType::Proto: {
+    auto &c = *static_cast<MALProto *>(obj)->chunk;
+    put((uint32_t)c.code.size());
+    put(c.frameSize);
+    put(c.numParams);
+    put((uint8_t)c.variadic);
+    put((uint16_t)c.upvalues.size());
+    put((uint16_t)c.constants.size());
+    out.append(reinterpret_cast<const char *>(c.code.data()),
+               c.code.size() * sizeof(byteCode));
+    for (auto &uv : c.upvalues) {
+      put((uint8_t)uv.inStack);
+      put(uv.index);
+    }
+    putString(c.name);
+    putString(c.file ? *c.file : std::string());
+    put(c.line);
+    put((uint32_t)c.lines.size());
+    out.append(reinterpret_cast<const char *>(c.lines.data()),
+               c.lines.size() * sizeof(LineInfo));
+    for (auto m : c.constants) {
+      putValue(m);
+    }
+    break;
+  }
+  case ObjType::Closure: {
+    auto cl = static_cast<MALClosure *>(obj);
+    putValue(cl->proto);
+    put((uint32_t)cl->upvalues.size());
+    for (auto uv : cl->upvalues) {
+      putValue(uv);
+    }
+    break;
+  }
+  case ObjType::Upvalue:
+    putValue(*static_cast<MALUpvalue *>(obj)->v);
+    break;
+  }
+}
+
+bool MALState::State::saveSnapshot(const std::string &path) {
+  // Only closed upvalues can be saved, and those are all there are while no
+  // code is running.
+  if (!frames.empty() || openUpvalues) {
+    error = std::make_shared<MALError>(
+        "A snapshot can't be saved while code is running");
+    return false;
+  }
+  SnapshotWriter w;
+  w.collect(globals.values);
+
+  SnapshotHeader header;
+  std::memcpy(header.magic, SnapshotHeader::MAGIC, sizeof(header.magic));
+  header.version = SnapshotHeader::VERSION;
+  header.byteOrder = SnapshotHeader::BYTE_ORDER_MARK;
+  header.globalCount = (uint32_t)globals.names.size();
+  header.objectCount = (uint32_t)w.objects.size();
+  w.put(header);
+  for (auto &name : globals.names) {
+    w.putString(name);
+  }
+  for (auto obj : w.objects) {
+    w.put(obj->type);
+  }
+  for (auto obj : w.objects) {
+    w.putObject(obj);
+  }
+  for (auto m : globals.values) {
+    w.putValue(m);
+  }
+  return writeFileAtomically(path, w.out, error);
+}
+
+struct SnapshotReader {
+  SnapshotReader(const char *cur, const char *end, Heap &heap)
+      : cur(cur), end(end), heap(heap){};
+
+  template <typename T> bool get(T &v) {
+    if ((size_t)(end - cur) < sizeof(v)) {
+      return false;
+    }
+    std::memcpy(&v, cur, sizeof(v));
+    cur += sizeof(v);
+    return true;
+  }
+
+  bool getString(std::string_view &str) {
+    uint32_t len;
+    if (!get(len) || (size_t)(end - cur) < len) {
+      return false;
+    }
+    str = std::string_view(cur, len);
+    cur += len;
+    return true;
+  }
+
+  // Reads a value that refers to an object already in the table.
+  bool getValue(MALType &m) {
+    uint64_t bits;
+    if (!get(bits)) {
+      return false;
+    }
+    m.bits = bits;
+    if (!m.isObj()) {
+      return true;
+    }
+    auto id = (size_t)(uintptr_t)m.asObj();
+    if (id == 0 || id > objects.size() || !objects[id - 1]) {
+      return false;
+    }
+    m = MALType{objects[id - 1]};
+    return true;
+  }
+
+  // Reads a reference to a T, which may be nil for a null pointer.
+  template <typename T> bool getRef(T *&ref) {
+    MALType m;
+    if (!getValue(m)) {
+      return false;
+    }
+    ref = m.as<T>();
+    return ref || m.isNil();
+  }
+
+  bool allocate(ObjType type, MALObject *&obj);
+  bool fill(MALObject *obj);
+
+  const char *cur;
+  const char *end;
+  Heap &heap;
+  std::vector<MALObject *> objects;
+  std::shared_ptr<const std::string> file; // Shared by the protos read from it.
+};
+
+// Allocates a container empty, to be filled in later, or reads an atom.
+bool SnapshotReader::allocate(ObjType type, MALObject *&obj) {
+  switch (type) {
+  case ObjType::List:
+    obj = heap.alloc<MALList>();
+    return true;
+  case ObjType::Vector:
+    obj = heap.alloc<MALVector>();
+    return true;
+  case ObjType::VecNode:
+    obj = heap.alloc<MALVecNode>();
+    return true;
+  case ObjType::Map:
+    obj = heap.alloc<MALMap>();
+    return true;
+  case ObjType::MapNode:
+    obj = heap.alloc<MALMapNode>();
+    return true;
+  case ObjType::Proto:
+    obj = heap.alloc<MALProto>(std::make_unique<Chunk>());
+    return true;
+  case ObjType::Closure:
+    obj = heap.alloc<MALClosure>(nullptr);
+    return true;
+  case ObjType::Upvalue: {
+    auto uv = heap.alloc<MALUpvalue>(nullptr, 0);
+    uv->v = &uv->closed;
+    obj = uv;
+    return true;
+  }
+  case ObjType::Symbol:
+  case ObjType::Keyword:
+  case ObjType::String:
+  case ObjType::Int:
+  case ObjType::CFunc:
+    // Read with their records, which come first.
+    obj = nullptr;
+    return true;
+  }
+  return false;
+}
+
+bool SnapshotReader::fill(MALObject *obj) {
+  switch (obj->type) {
+  case ObjType::List: {
+    auto l = static_cast<MALList *>(obj);
+    uint64_t cnt;
+    if (!getValue(l->first) || !getRef(l->rest) || !get(cnt)) {
+      return false;
+    }
+    l->cnt = (size_t)cnt;
+    return true;
+  }
+  case ObjType::Vector: {
+    auto v = static_cast<MALVector *>(obj);
+    uint64_t cnt;
+    uint32_t shift, tailSize;
+    if (!get(cnt) || !get(shift) || !getRef(v->root) || !get(tailSize) ||
+        tailSize > MALVector::WIDTH) {
+      return false;
+    }
+    v->cnt = (size_t)cnt;
+    v->shift = shift;
+    v->tail.resize(tailSize);
+    for (auto &m : v->tail) {
+      if (!getValue(m)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  case ObjType::VecNode:
+    for (auto &m : static_cast<MALVecNode *>(obj)->slots) {
+      if (!getValue(m)) {
+        return false;
+      }
+    }
+    return true;
+  case ObjType::Map: {
+    auto m = static_cast<MALMap *>(obj);
+    uint64_t cnt;
+    if (!get(cnt) || !getRef(m->root)) {
+      return false;
+    }
+    m->cnt = (size_t)cnt;
+    return true;
+  }
+  case ObjType::MapNode: {
+    auto n = static_cast<MALMapNode *>(obj);
+    uint32_t size;
+    if (!get(n->datamap) || !get(n->nodemap) || !get(size) ||
+        (size_t)(end - cur) / sizeof(uint64_t) < size) {
+      return false;
+    }
+    n->slots.resize(size);
+    for (auto &m : n->slots) {
+      if (!getValue(m)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  case ObjType::Proto: {
+    auto &c = *static_cast<MALProto *>(obj)->chunk;
+    uint32_t codeSize;
+    uint8_t variadic;
+    uint16_t upvalueCount, constantCount;
+    if (!get(codeSize) || !get(c.frameSize) || !get(c.numParams) ||
+        !get(variadic) || !get(upvalueCount) || !get(constantCount) ||
+        (size_t)(end - cur) / sizeof(byteCode) < codeSize) {
+      return false;
+    }
+    c.variadic = variadic;
+    // Globals are restored into the same slots, so the code needs no fixups.
+    c.code.resize(codeSize);
+    std::memcpy(c.code.data(), cur, codeSize * sizeof(byteCode));
+    cur += codeSize * sizeof(byteCode);
+    for (uint16_t i = 0; i < upvalueCount; i++) {
+      uint8_t inStack;
+      reg index;
+      if (!get(inStack) || !get(index)) {
+        return false;
+      }
+      c.upvalues.push_back(UpvalDesc{inStack != 0, index});
+    }
+    std::string_view name, file;
+    uint32_t lineCount;
+    if (!getString(name) || !getString(file) || !get(c.line) ||
+        !get(lineCount) ||
+        (size_t)(end - cur) / sizeof(LineInfo) < lineCount) {
+      return false;
+    }
+    c.name = name;
+    if (!file.empty()) {
+      if (!this->file || *this->file != file) {
+        this->file = std::make_shared<const std::string>(file);
+      }
+      c.file = this->file;
+    }
+    c.lines.resize(lineCount);
+    std::memcpy(c.lines.data(), cur, lineCount * sizeof(LineInfo));
+    cur += lineCount * sizeof(LineInfo);
+    for (uint16_t i = 0; i < constantCount; i++) {
+      MALType k;
+      if (!getValue(k)) {
+        return false;
+      }
+      c.constants.push_back(k);
+    }
+    return true;
+  }
+  case ObjType::Closure: {
+    auto cl = static_cast<MALClosure *>(obj);
+    uint32_t count;
+    if (!getRef(cl->proto) || !cl->proto || !get(count)) {
+      return false;
+    }
+    cl->upvalues.resize(count);
+    for (auto &uv : cl->upvalues) {
+      if (!getRef(uv) || !uv) {
+        return false;
+      }
+    }
+    return true;
+  }
+  case ObjType::Upvalue: {
+    auto uv = static_cast<MALUpvalue *>(obj);
+    return getValue(uv->closed);
+  }
+  case ObjType::Symbol:
+  case ObjType::Keyword:
+  case ObjType::String:
+  case ObjType::Int:
+  case ObjType::CFunc:
+    break;
+  }
+  return false;
+}
+
+bool MALState::State::restoreSnapshot(const std::string &path) {
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    error = std::make_shared<MALError>(path + ": " + std::strerror(errno));
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+    close(fd);
+    error = std::make_shared<MALError>(path + ": not a snapshot");
+    return false;
+  }
+  auto size = (size_t)st.st_size;
+  auto data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    error = std::make_shared<MALError>(path + ": " + std::strerror(errno));
+    return false;
+  }
+  auto begin = static_cast<const char *>(data);
+  SnapshotReader in(begin, begin + size, heap);
+  auto ok = [&]() {
+    SnapshotHeader header;
+    in.get(header);
+    if (std::memcmp(header.magic, SnapshotHeader::MAGIC,
+                    sizeof(header.magic))) {
+      error = std::make_shared<MALError>(path + ": not a snapshot");
+      return false;
+    }
+    if (header.version != SnapshotHeader::VERSION ||
+        header.byteOrder != SnapshotHeader::BYTE_ORDER_MARK) {
+      error = std::make_shared<MALError>(
+          path + ": snapshot was written by another version or machine");
+      return false;
+    }
+
+    if (header.globalCount > Globals::MAX_SLOTS) {
+      return false;
+    }
+    std::vector<std::string_view> names(header.globalCount);
+    for (auto &name : names) {
+      if (!in.getString(name)) {
+        return false;
+      }
+    }
+    if ((size_t)(in.end - in.cur) < header.objectCount) {
+      return false;
+    }
+    in.objects.resize(header.objectCount);
+    auto types = in.cur;
+    in.cur += header.objectCount;
+    for (uint32_t i = 0; i < header.objectCount; i++) {
+      if (!in.allocate((ObjType)types[i], in.objects[i])) {
+        return false;
+      }
+    }
+
+    for (uint32_t i = 0; i < header.objectCount; i++) {
+      std::string_view str;
+      switch ((ObjType)types[i]) {
+      case ObjType::Symbol:
+      case ObjType::Keyword:
+      case ObjType::String:
+        if (!in.getString(str)) {
+          return false;
+        }
+        if ((ObjType)types[i] == ObjType::Symbol) {
+          in.objects[i] = heap.intern(str);
+        } else if ((ObjType)types[i] == ObjType::Keyword) {
+          in.objects[i] = heap.internKeyword(str);
+        } else {
+          in.objects[i] = heap.internString(str);
+        }
+        break;
+      case ObjType::Int: {
+        int64_t n;
+        if (!in.get(n) || MALType::fitsInline(n)) {
+          return false;
+        }
+        in.objects[i] = heap.alloc<MALInt>(n);
+        break;
+      }
+      case ObjType::CFunc: {
+        const Builtin *b;
+        if (!in.getString(str) || !(b = findBuiltin(str))) {
+          return false;
+        }
+        in.objects[i] = heap.alloc<MALCFunc>(b->fn, b->name, b->binop);
+        break;
+      }
+      default:
+        if (!in.fill(in.objects[i])) {
+          return false;
+        }
+      }
+    }
+
+    // The globals get the slots they had, which the restored code uses.
+    Globals restored;
+    for (auto &name : names) {
+      MALType m;
+      if (!in.getValue(m)) {
+        return false;
+      }
+      restored.define(std::string(name), m);
+    }
+    if (restored.values.size() != names.size()) {
+      return false;
+    }
+    globals = std::move(restored);
+    // Builtins added since the snapshot was taken get new slots.
+    if (!initGlobals()) {
+      error = std::make_shared<MALError>(path + ": too many globals");
+      return false;
+    }
+    return true;
+  }();
+  munmap(data, size);
+  if (!ok && !error) {
+    error = std::make_shared<MALError>(path + ": corrupt snapshot");
+  }
+  return ok;
+}
+
+bool MALState::save_snapshot(const std::string &path) {
+  return state->saveSnapshot(path);
+}
+
+bool MALState::restore_snapshot(const std::string &path) {
+  return state->restoreSnapshot(path);
+}
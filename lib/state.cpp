@@ -1,133 +1,198 @@
 #include "state.hpp"
+#include "arith.hpp"
+#include "image.hpp"
+#include "instrument.hpp"
 #include "mal.hpp"
+#include "printer.hpp"
+#include "reader.hpp"
 #include "types.hpp"
 
+#include <iostream>
+#include <iterator>
 #include <memory>
-#include <variant>
+#include <vector>
 
 MALState::MALState() : state(new MALState::State(*this)) {}
 
-MALState::~MALState() { delete state; }
+MALState::~MALState() {
+#ifdef MAL_INSTRUMENT
+  if (state) {
+    state->stats.dump(std::cerr);
+  }
+#endif
+  delete state;
+}
+
+std::string MALState::print_str(int reg, bool readably) const {
+  std::string ret;
+  print_str(reg, ret, readably);
+  return ret;
+}
 
-std::string MALState::print_str(int reg) const {
-  return state->stack[(size_t)reg];
+void MALState::print_str(int reg, std::string &out, bool readably) const {
+  Printer(out, readably).print(state->stack[(size_t)reg]);
 }
 
 std::string MALState::get_error() const { return *state->error; }
 
 void MALState::clear_error() { state->error = nullptr; }
 
-bool MALState::add(MALState *M, size_t argCount) {
-  assert(argCount == 2);
-  auto state = M->state;
-  auto a = state->stackTop[0];
-  auto b = state->stackTop[1];
-  auto a_int = std::get_if<int>(&a.data);
-  auto b_int = std::get_if<int>(&b.data);
-  auto a_float = std::get_if<double>(&a.data);
-  auto b_float = std::get_if<double>(&b.data);
-  if (a_int && b_int) {
-    state->stackTop[0] = MALType{*a_int + *b_int};
-    return true;
+bool MALState::load_file(const std::string &path) {
+  return state->loadFile(path);
+}
+
+bool MALState::compile_file(const std::string &path,
+                            const std::string &image) {
+  return state->compileFile(path, image);
+}
+
+void MALState::State::resetArena() {
+  if (unread && unreadReg < stack.size() && stack[unreadReg].isObj() &&
+      stack[unreadReg].asObj() == unread) {
+    stack[unreadReg] = MALType();
   }
-  if (a_int && b_float) {
-    state->stackTop[0] = MALType{*a_int + *b_float};
-    return true;
+  unread = nullptr;
+  arena.reset();
+  lines.clear();
+}
+
+bool MALState::State::run(FormReader &in, ImageWriter *image) {
+  MALType form;
+  while (in.next(heap, arena, lines, form)) {
+    // Each form runs in the register at stackTop, so loads may nest.
+    if (!compile(form, 0, in.file)) {
+      return false;
+    }
+    if (image && !image->add(*proto)) {
+      error = image->error;
+      return false;
+    }
+    if (!eval(0)) {
+      return false;
+    }
   }
-  if (a_float && b_int) {
-    state->stackTop[0] = MALType{*a_float + *b_int};
-    return true;
+  if (in.error) {
+    error = in.error;
+    return false;
   }
+  return true;
+}
 
-  state->error = std::make_shared<MALError>("Illegal arguments to add");
-  return false;
+bool MALState::State::run(ImageReader &in) {
+  // Forms are loaded as they are run, so that the one running is the only
+  // one the collector needs to know about.
+  while (in.next(heap, globals, proto)) {
+    if (!eval(0)) {
+      return false;
+    }
+  }
+  if (in.error) {
+    error = in.error;
+    return false;
+  }
+  return true;
 }
 
-bool MALState::mult(MALState *M, size_t argCount) {
-  assert(argCount == 2);
-  auto state = M->state;
-  auto a = state->stackTop[0];
-  auto b = state->stackTop[1];
-  auto a_int = std::get_if<int>(&a.data);
-  auto b_int = std::get_if<int>(&b.data);
-  auto a_float = std::get_if<double>(&a.data);
-  auto b_float = std::get_if<double>(&b.data);
-  if (a_int && b_int) {
-    state->stackTop[0] = MALType{*a_int * *b_int};
-    return true;
+bool MALState::State::loadFile(const std::string &path) {
+  if (auto image = ImageReader::open(path, globals, error)) {
+    return run(*image);
   }
-  if (a_int && b_float) {
-    state->stackTop[0] = MALType{*a_int * *b_float};
-    return true;
+  if (error) {
+    return false;
   }
-  if (a_float && b_int) {
-    state->stackTop[0] = MALType{*a_float * *b_int};
-    return true;
+  auto in = FormReader::open(path, error);
+  return in && run(*in);
+}
+
+bool MALState::State::compileFile(const std::string &path,
+                                  const std::string &imagePath) {
+  auto in = FormReader::open(path, error);
+  ImageWriter image;
+  if (!in || !run(*in, &image)) {
+    return false;
+  }
+  if (!image.write(imagePath, globals)) {
+    error = image.error;
+    return false;
   }
+  return true;
+}
 
-  state->error = std::make_shared<MALError>("Illegal arguments to multiply");
-  return false;
+void MALState::set_stack_limit(size_t n) { state->maxStack = n; }
+
+void MALState::set_optimize(bool on) { state->optimize = on; }
+
+bool MALState::start_profile(unsigned hz) {
+  return state->profiler.start(hz, state->error);
 }
 
-bool MALState::sub(MALState *M, size_t argCount) {
-  assert(argCount == 2);
-  auto state = M->state;
-  auto a = state->stackTop[0];
-  auto b = state->stackTop[1];
-  auto a_int = std::get_if<int>(&a.data);
-  auto b_int = std::get_if<int>(&b.data);
-  auto a_float = std::get_if<double>(&a.data);
-  auto b_float = std::get_if<double>(&b.data);
-  if (a_int && b_int) {
-    state->stackTop[0] = MALType{*a_int - *b_int};
-    return true;
-  }
-  if (a_int && b_float) {
-    state->stackTop[0] = MALType{*a_int - *b_float};
-    return true;
+bool MALState::stop_profile(const std::string &path) {
+  state->profiler.stop();
+  return state->profiler.write(path, state->error);
+}
+
+template <BinOp op>
+static bool callBinop(Heap &heap, MALType *args, size_t argCount,
+                      std::shared_ptr<MALError> &error) {
+  if (argCount != 2) {
+    error = std::make_shared<MALError>("Wrong number of arguments");
+    return false;
   }
-  if (a_float && b_int) {
-    state->stackTop[0] = MALType{*a_float - *b_int};
-    return true;
+  if (auto err = binop<op>(heap, args[0], args[1], args[0])) {
+    error = std::make_shared<MALError>(err);
+    return false;
   }
+  return true;
+}
 
-  state->error = std::make_shared<MALError>("Illegal arguments to sub");
-  return false;
+bool MALState::add(MALState *M, size_t argCount) {
+  return callBinop<BinOp::Add>(M->state->heap, &M->state->stackTop[0],
+                               argCount, M->state->error);
+}
+
+bool MALState::mult(MALState *M, size_t argCount) {
+  return callBinop<BinOp::Mul>(M->state->heap, &M->state->stackTop[0],
+                               argCount, M->state->error);
+}
+
+bool MALState::sub(MALState *M, size_t argCount) {
+  return callBinop<BinOp::Sub>(M->state->heap, &M->state->stackTop[0],
+                               argCount, M->state->error);
 }
 
 bool MALState::div(MALState *M, size_t argCount) {
-  assert(argCount == 2);
-  auto state = M->state;
-  auto a = state->stackTop[0];
-  auto b = state->stackTop[1];
-  auto a_int = std::get_if<int>(&a.data);
-  auto b_int = std::get_if<int>(&b.data);
-  auto a_float = std::get_if<double>(&a.data);
-  auto b_float = std::get_if<double>(&b.data);
-  if (a_int && b_int) {
-    state->stackTop[0] = MALType{*a_int / *b_int};
-    return true;
-  }
-  if (a_int && b_float) {
-    state->stackTop[0] = MALType{*a_int / *b_float};
-    return true;
-  }
-  if (a_float && b_int) {
-    state->stackTop[0] = MALType{*a_float / *b_int};
-    return true;
-  }
+  return callBinop<BinOp::Div>(M->state->heap, &M->state->stackTop[0],
+                               argCount, M->state->error);
+}
 
-  state->error = std::make_shared<MALError>("Illegal arguments to sub");
-  return false;
+bool MALState::lt(MALState *M, size_t argCount) {
+  return callBinop<BinOp::Lt>(M->state->heap, &M->state->stackTop[0],
+                              argCount, M->state->error);
+}
+
+bool MALState::le(MALState *M, size_t argCount) {
+  return callBinop<BinOp::Le>(M->state->heap, &M->state->stackTop[0],
+                              argCount, M->state->error);
+}
+
+bool MALState::gt(MALState *M, size_t argCount) {
+  return callBinop<BinOp::Gt>(M->state->heap, &M->state->stackTop[0],
+                              argCount, M->state->error);
+}
+
+bool MALState::ge(MALState *M, size_t argCount) {
+  return callBinop<BinOp::Ge>(M->state->heap, &M->state->stackTop[0],
+                              argCount, M->state->error);
+}
+
+bool MALState::eq(MALState *M, size_t argCount) {
+  return callBinop<BinOp::Eq>(M->state->heap, &M->state->stackTop[0],
+                              argCount, M->state->error);
 }
 
 bool MALState::list(MALState *M, size_t argCount) {
-  auto ret = std::make_shared<MALList>(argCount);
-  auto stackPtr = M->state->stackTop;
-  for (size_t i = 0; i < argCount; i++) {
-    ret->data.push_back(*stackPtr);
-    stackPtr++;
-  }
+  auto args = &M->state->stackTop[0];
+  auto ret = MALList::from(M->state->heap, args, args + argCount);
   M->state->stackTop[0] = MALType{ret};
   return true;
 }
@@ -137,18 +202,14 @@ bool MALState::is_list(MALState *M, size_t argCount) {
     M->state->stackTop[0] = MALType{false};
     return true;
   }
-  auto arg = std::get_if<std::shared_ptr<MALList>>(&M->state->stackTop[0].data);
-  M->state->stackTop[0] = MALType{(bool)arg};
+  auto arg = M->state->stackTop[0].as<MALList>();
+  M->state->stackTop[0] = MALType{arg != nullptr};
   return true;
 }
 
 bool MALState::vec(MALState *M, size_t argCount) {
-  auto ret = std::make_shared<MALVector>(argCount);
-  auto stackPtr = M->state->stackTop;
-  for (size_t i = 0; i < argCount; i++) {
-    ret->data.push_back(*stackPtr);
-    stackPtr++;
-  }
+  auto args = &M->state->stackTop[0];
+  auto ret = MALVector::from(M->state->heap, args, args + argCount);
   M->state->stackTop[0] = MALType{ret};
   return true;
 }
@@ -160,10 +221,11 @@ bool MALState::hash_map(MALState *M, size_t argCount) {
     return false;
   }
 
-  auto ret = std::make_shared<MALMap>(argCount);
+  auto &heap = M->state->heap;
+  auto ret = heap.alloc<MALMap>();
   auto stackPtr = M->state->stackTop;
   for (size_t i = 0; i < argCount; i += 2) {
-    ret->data[(std::string)stackPtr[0]] = stackPtr[1];
+    ret = ret->assoc(heap, stackPtr[0], stackPtr[1]);
     stackPtr += 2;
   }
 
@@ -178,45 +240,448 @@ bool MALState::is_empty(MALState *M, size_t argCount) {
   }
 
   auto &var = M->state->stackTop[0];
-  auto [start, end] = std::visit(Iterator{var}, var.data);
-  if (start == nullptr) {
-    assert(end == nullptr);
+  if (auto m = var.as<MALMap>()) {
+    var = MALType{m->empty()};
+    return true;
+  }
+  auto seq = visit(Iterator{}, var);
+  if (!seq.valid) {
     M->state->error = std::make_shared<MALError>("Argument isn't sequenceable");
     return false;
   }
 
-  var = MALType{start == end};
+  var = MALType{seq.empty()};
   return true;
 }
 
 bool MALState::count(MALState *M, size_t argCount) {
   auto &var = M->state->stackTop[0];
-  if (argCount == 0 || std::holds_alternative<MALNil>(var.data)) {
+  if (argCount == 0 || var.isNil()) {
     var = MALType{0};
     return true;
   }
-  auto [start, end] = std::visit(Iterator{var}, var.data);
-  if (start == nullptr) {
-    assert(end == nullptr);
+  if (auto m = var.as<MALMap>()) {
+    var = MALType{(int)m->size()};
+    return true;
+  }
+  auto seq = visit(Iterator{}, var);
+  if (!seq.valid) {
     M->state->error = std::make_shared<MALError>("Argument isn't sequenceable");
     return false;
   }
-  var = MALType{(int)(end - start)};
+  var = MALType{(int)seq.size()};
   return true;
 }
 
-void MALState::State::initGlobals() {
-  globals.data["+"] = MALType{std::make_shared<MALCFunc>(add, "+")};
-  globals.data["-"] = MALType{std::make_shared<MALCFunc>(sub, "-")};
-  globals.data["*"] = MALType{std::make_shared<MALCFunc>(mult, "*")};
-  globals.data["/"] = MALType{std::make_shared<MALCFunc>(div, "/")};
+bool MALState::nth(MALState *M, size_t argCount) {
+  auto args = M->state->stackTop;
+  if (argCount != 2) {
+    M->state->error = std::make_shared<MALError>("nth takes 2 arguments");
+    return false;
+  }
+  int64_t n;
+  if (!toInt(args[1], n)) {
+    M->state->error = std::make_shared<MALError>("nth index isn't an integer");
+    return false;
+  }
+  auto i = (size_t)n;
+  if (auto v = args[0].as<MALVector>()) {
+    if (n < 0 || i >= v->size()) {
+      M->state->error = std::make_shared<MALError>("nth index out of range");
+      return false;
+    }
+    args[0] = (*v)[i];
+    return true;
+  }
+  if (auto l = args[0].as<MALList>()) {
+    if (n < 0 || i >= l->size()) {
+      M->state->error = std::make_shared<MALError>("nth index out of range");
+      return false;
+    }
+    args[0] = *std::next(l->begin(), (ptrdiff_t)i);
+    return true;
+  }
+  M->state->error = std::make_shared<MALError>("Argument isn't sequenceable");
+  return false;
+}
 
-  globals.data["vec"] = MALType{std::make_shared<MALCFunc>(vec, "vec")};
-  globals.data["list"] = MALType{std::make_shared<MALCFunc>(list, "list")};
-  globals.data["list?"] = MALType{std::make_shared<MALCFunc>(is_list, "list?")};
-  globals.data["hash-map"] =
-      MALType{std::make_shared<MALCFunc>(hash_map, "hash-map")};
-  globals.data["empty?"] =
-      MALType{std::make_shared<MALCFunc>(is_empty, "empty?")};
-  globals.data["count"] = MALType{std::make_shared<MALCFunc>(count, "count")};
+bool MALState::conj(MALState *M, size_t argCount) {
+  auto args = M->state->stackTop;
+  auto &heap = M->state->heap;
+  if (argCount == 0) {
+    M->state->error =
+        std::make_shared<MALError>("Not enough arguments to conj");
+    return false;
+  }
+  if (auto v = args[0].as<MALVector>()) {
+    for (size_t i = 1; i < argCount; i++) {
+      v = v->conj(heap, args[i]);
+    }
+    args[0] = MALType{v};
+    return true;
+  }
+  if (auto l = args[0].as<MALList>()) {
+    // Lists grow at the front.
+    for (size_t i = 1; i < argCount; i++) {
+      l = l->cons(heap, args[i]);
+    }
+    args[0] = MALType{l};
+    return true;
+  }
+  M->state->error = std::make_shared<MALError>("Can't conj onto argument");
+  return false;
+}
+
+bool MALState::cons(MALState *M, size_t argCount) {
+  auto args = M->state->stackTop;
+  auto &heap = M->state->heap;
+  if (argCount != 2) {
+    M->state->error = std::make_shared<MALError>("cons takes 2 arguments");
+    return false;
+  }
+  if (args[1].isNil()) {
+    args[0] = MALType{heap.alloc<MALList>(args[0], nullptr)};
+    return true;
+  }
+  if (auto l = args[1].as<MALList>()) {
+    args[0] = MALType{l->cons(heap, args[0])};
+    return true;
+  }
+  auto seq = visit(Iterator{}, args[1]);
+  if (!seq.valid) {
+    M->state->error = std::make_shared<MALError>("Argument isn't sequenceable");
+    return false;
+  }
+  // Other sequences are copied into cells first.
+  std::vector<MALType> data{args[0]};
+  data.insert(data.end(), seq.begin(), seq.end());
+  args[0] =
+      MALType{MALList::from(heap, data.data(), data.data() + data.size())};
+  return true;
+}
+
+bool MALState::first(MALState *M, size_t argCount) {
+  auto args = M->state->stackTop;
+  if (argCount != 1) {
+    M->state->error = std::make_shared<MALError>("first takes 1 argument");
+    return false;
+  }
+  if (args[0].isNil()) {
+    return true;
+  }
+  auto seq = visit(Iterator{}, args[0]);
+  if (!seq.valid) {
+    M->state->error = std::make_shared<MALError>("Argument isn't sequenceable");
+    return false;
+  }
+  args[0] = seq.empty() ? MALType() : *seq.begin();
+  return true;
+}
+
+bool MALState::rest(MALState *M, size_t argCount) {
+  auto args = M->state->stackTop;
+  auto &heap = M->state->heap;
+  if (argCount != 1) {
+    M->state->error = std::make_shared<MALError>("rest takes 1 argument");
+    return false;
+  }
+  if (auto l = args[0].as<MALList>(); l && l->rest) {
+    // The tail of a list is shared rather than copied.
+    args[0] = MALType{l->rest};
+    return true;
+  }
+  if (args[0].isNil()) {
+    args[0] = MALType{heap.alloc<MALList>()};
+    return true;
+  }
+  auto seq = visit(Iterator{}, args[0]);
+  if (!seq.valid) {
+    M->state->error = std::make_shared<MALError>("Argument isn't sequenceable");
+    return false;
+  }
+  std::vector<MALType> data;
+  if (!seq.empty()) {
+    data.assign(std::next(seq.begin()), seq.end());
+  }
+  args[0] =
+      MALType{MALList::from(heap, data.data(), data.data() + data.size())};
+  return true;
+}
+
+bool MALState::assoc(MALState *M, size_t argCount) {
+  auto args = M->state->stackTop;
+  auto &heap = M->state->heap;
+  if (argCount == 0 || !(argCount & 1)) {
+    M->state->error = std::make_shared<MALError>(
+        "assoc requires a collection and key value pairs");
+    return false;
+  }
+  if (auto v = args[0].as<MALVector>()) {
+    for (size_t i = 1; i < argCount; i += 2) {
+      if (!args[i].isInt() || args[i].asInt() < 0 ||
+          (size_t)args[i].asInt() > v->size()) {
+        M->state->error =
+            std::make_shared<MALError>("assoc index out of range");
+        return false;
+      }
+      v = v->assoc(heap, (size_t)args[i].asInt(), args[i + 1]);
+    }
+    args[0] = MALType{v};
+    return true;
+  }
+  if (auto m = args[0].as<MALMap>()) {
+    for (size_t i = 1; i < argCount; i += 2) {
+      m = m->assoc(heap, args[i], args[i + 1]);
+    }
+    args[0] = MALType{m};
+    return true;
+  }
+  M->state->error = std::make_shared<MALError>("Can't assoc onto argument");
+  return false;
+}
+
+bool MALState::dissoc(MALState *M, size_t argCount) {
+  auto args = M->state->stackTop;
+  if (argCount == 0) {
+    M->state->error =
+        std::make_shared<MALError>("Not enough arguments to dissoc");
+    return false;
+  }
+  auto m = args[0].as<MALMap>();
+  if (!m) {
+    M->state->error = std::make_shared<MALError>("Can't dissoc from argument");
+    return false;
+  }
+  for (size_t i = 1; i < argCount; i++) {
+    m = m->dissoc(M->state->heap, args[i]);
+  }
+  args[0] = MALType{m};
+  return true;
+}
+
+// Returns the map argument of get and friends, which may also be nil.
+static bool mapArg(MALType *args, std::shared_ptr<MALError> &error,
+                   size_t argCount, size_t expected, const char *name,
+                   MALMap *&m) {
+  if (argCount != expected) {
+    error = std::make_shared<MALError>(std::string(name) + " takes " +
+                                       std::to_string(expected) + " arguments");
+    return false;
+  }
+  m = args[0].as<MALMap>();
+  if (!m && !args[0].isNil()) {
+    error = std::make_shared<MALError>(std::string(name) +
+                                       " argument isn't a map");
+    return false;
+  }
+  return true;
+}
+
+bool MALState::get(MALState *M, size_t argCount) {
+  MALMap *m;
+  if (!mapArg(&M->state->stackTop[0], M->state->error, argCount, 2, "get",
+              m)) {
+    return false;
+  }
+  auto value = m ? m->get(M->state->stackTop[1]) : nullptr;
+  M->state->stackTop[0] = value ? *value : MALType();
+  return true;
+}
+
+bool MALState::contains(MALState *M, size_t argCount) {
+  MALMap *m;
+  if (!mapArg(&M->state->stackTop[0], M->state->error, argCount, 2, "contains?",
+              m)) {
+    return false;
+  }
+  M->state->stackTop[0] =
+      MALType{m != nullptr && m->get(M->state->stackTop[1]) != nullptr};
+  return true;
+}
+
+bool MALState::keys(MALState *M, size_t argCount) {
+  MALMap *m;
+  if (!mapArg(&M->state->stackTop[0], M->state->error, argCount, 1, "keys",
+              m)) {
+    return false;
+  }
+  auto &heap = M->state->heap;
+  auto ret = heap.alloc<MALList>();
+  if (m) {
+    m->forEach([&](MALType key, MALType) { ret = ret->cons(heap, key); });
+  }
+  M->state->stackTop[0] = MALType{ret};
+  return true;
+}
+
+bool MALState::vals(MALState *M, size_t argCount) {
+  MALMap *m;
+  if (!mapArg(&M->state->stackTop[0], M->state->error, argCount, 1, "vals",
+              m)) {
+    return false;
+  }
+  auto &heap = M->state->heap;
+  auto ret = heap.alloc<MALList>();
+  if (m) {
+    m->forEach([&](MALType, MALType value) { ret = ret->cons(heap, value); });
+  }
+  M->state->stackTop[0] = MALType{ret};
+  return true;
+}
+
+static bool pathArg(MALType *args, std::shared_ptr<MALError> &error,
+                    size_t argCount, const char *name, std::string &path) {
+  auto str = argCount == 1 ? args[0].as<MALString>() : nullptr;
+  if (!str || str->str.empty()) {
+    error = std::make_shared<MALError>(std::string(name) +
+                                       " takes a file name");
+    return false;
+  }
+  path = str->str;
+  return true;
+}
+
+bool MALState::load(MALState *M, size_t argCount) {
+  std::string path;
+  if (!pathArg(&M->state->stackTop[0], M->state->error, argCount,
+               "load-file", path) ||
+      !M->state->loadFile(path)) {
+    return false;
+  }
+  M->state->stackTop[0] = MALType();
+  return true;
+}
+
+bool MALState::read_file(MALState *M, size_t argCount) {
+  std::string path;
+  if (!pathArg(&M->state->stackTop[0], M->state->error, argCount,
+               "read-file", path)) {
+    return false;
+  }
+  auto in = FormReader::open(path, M->state->error);
+  if (!in) {
+    return false;
+  }
+  std::vector<MALType> forms;
+  if (!in->readAll(M->state->heap, forms)) {
+    M->state->error = in->error;
+    return false;
+  }
+  M->state->stackTop[0] = MALType{MALList::from(
+      M->state->heap, forms.data(), forms.data() + forms.size())};
+  return true;
+}
+
+#ifdef MAL_INSTRUMENT
+bool MALState::vm_stats(MALState *M, size_t argCount) {
+  if (argCount != 0) {
+    M->state->error =
+        std::make_shared<MALError>("vm-stats takes no arguments");
+    return false;
+  }
+  auto &heap = M->state->heap;
+  auto &stats = M->state->stats;
+  auto name = [&](std::string_view s) { return MALType{heap.internString(s)}; };
+  auto count = [&](uint64_t n) { return makeInt(heap, (int64_t)n); };
+
+  auto ops = heap.alloc<MALMap>();
+  auto allocs = heap.alloc<MALMap>();
+  auto pairs = heap.alloc<MALMap>();
+  for (size_t i = 0; i < OPCODE_COUNT; i++) {
+    if (stats.ops[i] > 0) {
+      ops = ops->assoc(heap, name(opcodeNames[i]), count(stats.ops[i]));
+    }
+    if (stats.allocs[i] > 0) {
+      allocs =
+          allocs->assoc(heap, name(opcodeNames[i]), count(stats.allocs[i]));
+    }
+    for (size_t j = 0; j < OPCODE_COUNT; j++) {
+      if (stats.pairs[i][j] > 0) {
+        MALType pair[] = {name(opcodeNames[i]), name(opcodeNames[j])};
+        auto key = MALType{MALVector::from(heap, pair, pair + 2)};
+        pairs = pairs->assoc(heap, key, count(stats.pairs[i][j]));
+      }
+    }
+  }
+  // Each builtin maps to how often it was called and the nanoseconds spent in
+  // it, including any code it ran.
+  auto builtins = heap.alloc<MALMap>();
+  for (auto &[fn, s] : stats.cfuncs) {
+    MALType row[] = {count(s.calls), count(s.ns)};
+    builtins = builtins->assoc(heap, name(fn),
+                               MALType{MALVector::from(heap, row, row + 2)});
+  }
+
+  auto ret = heap.alloc<MALMap>();
+  auto field = [&](std::string_view key, MALMap *value) {
+    ret = ret->assoc(heap, MALType{heap.internKeyword(key)}, MALType{value});
+  };
+  field(":ops", ops);
+  field(":pairs", pairs);
+  field(":allocs", allocs);
+  field(":builtins", builtins);
+  M->state->stackTop[0] = MALType{ret};
+  return true;
+}
+#endif
+
+const MALState::State::Builtin MALState::State::builtins[] = {
+    {"+", add, BinOp::Add},
+    {"-", sub, BinOp::Sub},
+    {"*", mult, BinOp::Mul},
+    {"/", div, BinOp::Div},
+    {"<", lt, BinOp::Lt},
+    {"<=", le, BinOp::Le},
+    {">", gt, BinOp::Gt},
+    {">=", ge, BinOp::Ge},
+    {"=", eq, BinOp::Eq},
+
+    {"vec", vec, BinOp::None},
+    {"list", list, BinOp::None},
+    {"list?", is_list, BinOp::None},
+    {"hash-map", hash_map, BinOp::None},
+    {"empty?", is_empty, BinOp::None},
+    {"count", count, BinOp::None},
+    {"nth", nth, BinOp::None},
+    {"conj", conj, BinOp::None},
+    {"cons", cons, BinOp::None},
+    {"first", first, BinOp::None},
+    {"rest", rest, BinOp::None},
+    {"assoc", assoc, BinOp::None},
+    {"dissoc", dissoc, BinOp::None},
+    {"get", get, BinOp::None},
+    {"contains?", contains, BinOp::None},
+    {"keys", keys, BinOp::None},
+    {"vals", vals, BinOp::None},
+    {"load-file", load, BinOp::None},
+    {"read-file", read_file, BinOp::None},
+#ifdef MAL_INSTRUMENT
+    {"vm-stats", vm_stats, BinOp::None},
+#endif
+};
+
+const MALState::State::Builtin *
+MALState::State::findBuiltin(std::string_view name) {
+  for (auto &b : builtins) {
+    if (name == b.name) {
+      return &b;
+    }
+  }
+  return nullptr;
+}
+
+// Binds the builtins to their names, except where a name is bound already.
+// Fails if there is no slot left for one.
+bool MALState::State::initGlobals() {
+  for (auto &b : builtins) {
+    if (!globals.hasRoom(b.name)) {
+      return false;
+    }
+    auto slot = globals.slot(b.name);
+    if (!globals.isDefined(slot)) {
+      globals.values[slot] =
+          MALType{heap.alloc<MALCFunc>(b.fn, b.name, b.binop)};
+    }
+  }
+  return true;
 }
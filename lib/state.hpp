@@ -2,28 +2,113 @@
 
 #include "mal.hpp"
 
+#include "arena.hpp"
 #include "chunk.hpp"
+#include "globals.hpp"
+#include "heap.hpp"
+#include "instrument.hpp"
+#include "profiler.hpp"
 #include "types.hpp"
 
 #include <memory>
+#include <string>
+#include <string_view>
 #include <vector>
 
+struct FormReader;
+struct ImageReader;
+struct ImageWriter;
+
+// An active call. Frames live in a contiguous stack owned by the State, so
+// calls don't allocate.
+struct CallFrame {
+  MALType fn;
+  const byteCode *ip; // Where the caller resumes.
+  ptrdiff_t base;     // Offset of the callee's first register in the stack.
+};
+
 struct MALState::State {
   State(MALState &parent)
-      : stack(10), stackTop(stack.begin()), error(nullptr), parent(parent) {
+      : stack(INITIAL_STACK), stackTop(stack.begin()),
+        maxStack(DEFAULT_MAX_STACK), error(nullptr), parent(parent) {
+    frames.reserve(INITIAL_FRAMES);
     initGlobals();
   };
 
+  // Compiles form into proto, to leave its value in register r when run.
+  // file is where the form was read from, if anywhere.
+  bool compile(MALType form, int r,
+               std::shared_ptr<const std::string> file = nullptr);
+  // Frees the forms in the arena. A form read_str left in a register and
+  // that wasn't compiled is dropped, so the register doesn't dangle.
+  void resetArena();
   bool eval(int);
+  // Compiles and runs each form in turn, stopping at the first error. Each
+  // compiled form is also added to image if there is one.
+  bool run(FormReader &in, ImageWriter *image = nullptr);
+  bool run(ImageReader &in);
+  // Runs a source file or an image.
+  bool loadFile(const std::string &path);
+  // Runs a source file, saving its compiled forms as an image.
+  bool compileFile(const std::string &path, const std::string &imagePath);
+  // Saves the globals and everything reachable from them, or replaces the
+  // globals with those of a saved snapshot.
+  bool saveSnapshot(const std::string &path);
+  bool restoreSnapshot(const std::string &path);
+  void collectGarbage();
+
+  // Makes sure there are at least n registers starting at stackTop. This is
+  // checked once when a call is entered, so that instructions don't need to.
+  inline bool ensureStack(size_t n) {
+    if ((size_t)(stackTop - stack.begin()) + n <= stack.size()) {
+      return true;
+    }
+    return growStack(n);
+  };
 
+  // Registers guaranteed to a C function beyond its arguments.
+  static constexpr size_t MIN_C_STACK = 8;
+
+  Heap heap;
+  Arena arena; // Holds the forms read until they are compiled.
+  SourceLines lines; // Where the forms in the arena were read from.
+  MALObject *unread = nullptr; // The form read_str left in unreadReg.
+  size_t unreadReg = 0;
   std::vector<MALType> stack;
   std::vector<MALType>::iterator stackTop;
-  std::unique_ptr<Chunk> chunk;
+  std::vector<CallFrame> frames;
+  size_t maxStack;
+  MALProto *proto = nullptr; // The last compiled top level form.
+  MALUpvalue *openUpvalues = nullptr;
+  bool optimize = true; // Whether compile runs the optimizer.
   std::shared_ptr<MALError> error;
 
-  MALMap globals;
+  Globals globals;
+#ifdef MAL_INSTRUMENT
+  VMStats stats;
+#endif
+  Profiler profiler;
 
 private:
-  void initGlobals();
+  // A C function every state starts out with. Snapshots refer to them by
+  // name, since their addresses change from one build to the next.
+  struct Builtin {
+    const char *name;
+    CFunction fn;
+    BinOp binop;
+  };
+  static const Builtin builtins[];
+  static const Builtin *findBuiltin(std::string_view name);
+
+  static constexpr size_t INITIAL_STACK = 32;
+  static constexpr size_t DEFAULT_MAX_STACK = 1 << 20;
+  static constexpr size_t INITIAL_FRAMES = 64;
+
+  bool growStack(size_t n);
+  bool enterClosure(const MALClosure &cl, size_t nargs);
+  bool callCFunc(const MALCFunc &fn, size_t nargs);
+  MALUpvalue *findUpvalue(ptrdiff_t slot);
+  void closeUpvalues(ptrdiff_t level);
+  bool initGlobals();
   MALState &parent;
 };
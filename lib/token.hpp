@@ -1,5 +1,6 @@
 #pragma once
 
+#include "scan.hpp"
 #include "types.hpp"
 
 #include <memory>
@@ -20,6 +21,8 @@ enum struct TokenType {
   Unquote,
   SpliceUnquote,
   NIL,
+  TRUE,
+  FALSE,
 
   String,
   Identifier,
@@ -34,15 +37,34 @@ struct Token {
   int length;
 };
 
+// Splits the input into tokens. peek() remembers the token it found, so that
+// the scan() which usually follows doesn't have to find it again.
 struct Scanner {
+  // The input is [begin, end). *end must be a NUL, unless end is known to
+  // fall between two forms.
+  Scanner(const char *begin, const char *end)
+      : error(nullptr), hitEnd(false), current(begin), end(end),
+        runs(end), lookahead{TokenType::None, nullptr, 0},
+        peeked(false) {}
   Scanner(const std::string &str)
-      : error(nullptr), data(str), current(data.data()) {}
+      : Scanner(str.data(), str.data() + str.size()) {}
   Token scan(void);
   Token peek(void);
 
+  // Where the next token starts, once it has been peeked.
+  inline const char *position() const { return current; }
+
   std::shared_ptr<MALError> error;
+  // Set once the scanner has run into the end of its input. When the input is
+  // a prefix of a stream, that means the token may continue past it.
+  bool hitEnd;
 
 private:
-  const std::string &data;
+  Token next(void);
+
   const char *current;
+  const char *end;
+  RunFinder runs;
+  Token lookahead;
+  bool peeked;
 };
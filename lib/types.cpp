@@ -1,68 +1,170 @@
 #include "types.hpp"
 
+#include "chunk.hpp"
+#include "printer.hpp"
+
 #include <cassert>
-#include <memory>
-#include <sstream>
 #include <string>
 #include <variant>
 
-template <char start, char end>
-static inline std::string toString(std::vector<MALType> data) {
-  std::stringstream stream;
-  stream << start;
-  for (auto &m : data) {
-    stream << (std::string)m << " "; // TODO chanege to C++ style cast
-  }
-  if (stream.str().size() != 1) {
-    stream.seekp(-1, stream.cur);
-  }
-  stream << end;
-  return stream.str();
-}
+MALProto::MALProto(std::unique_ptr<Chunk> chunk)
+    : MALObject(TYPE), chunk(std::move(chunk)) {}
 
-MALList::operator std::string() { return toString<'(', ')'>(data); }
+MALProto::~MALProto() = default;
 
-MALVector::operator std::string() { return toString<'[', ']'>(data); }
+MALError::operator std::string() const {
+  return location.empty() ? msg : msg + " at " + location;
+}
 
-MALMap::operator std::string() {
-  std::stringstream stream;
-  stream << "{";
-  for (auto &m : data) {
-    stream << m.first << " ";
-    stream << (std::string)m.second << " "; // TODO chanege to C++ style cast
-  }
-  if (stream.str().size() != 1) {
-    stream.seekp(-1, stream.cur);
-  }
-  stream << "}";
-  return stream.str();
+MALType::operator std::string() const {
+  std::string ret;
+  Printer(ret, true).print(*this);
+  return ret;
+}
+
+template <typename T, typename U> static bool sequenceEquals(T *a, U *b) {
+  if (a->size() != b->size()) {
+    return false;
+  }
+  auto it = b->begin();
+  for (auto &m : *a) {
+    if (!equals(m, *it)) {
+      return false;
+    }
+    it++;
+  }
+  return true;
 }
 
-MALSymbol::operator std::string() const { return symbol; }
+bool equals(MALType a, MALType b) {
+  if (a.isInt() && b.isInt()) {
+    return a.asInt() == b.asInt();
+  }
+  if (a.isDouble() && b.isDouble()) {
+    return a.asDouble() == b.asDouble();
+  }
+  if (!a.isObj() || !b.isObj()) {
+    return a.bits == b.bits;
+  }
+  if (a.bits == b.bits) {
+    return true;
+  }
 
-MALKeyword::operator std::string() const { return keyword; }
+  auto aList = a.as<MALList>();
+  auto aVec = a.as<MALVector>();
+  auto bList = b.as<MALList>();
+  auto bVec = b.as<MALVector>();
+  if (aList && bList) {
+    return sequenceEquals(aList, bList);
+  }
+  if (aList && bVec) {
+    return sequenceEquals(aList, bVec);
+  }
+  if (aVec && bList) {
+    return sequenceEquals(aVec, bList);
+  }
+  if (aVec && bVec) {
+    return sequenceEquals(aVec, bVec);
+  }
 
-MALString::operator std::string() const { return str; }
+  auto x = a.asObj();
+  auto y = b.asObj();
+  if (x->type != y->type) {
+    return false;
+  }
+  switch (x->type) {
+  case ObjType::Map: {
+    auto m = static_cast<MALMap *>(x);
+    auto n = static_cast<MALMap *>(y);
+    if (m->size() != n->size()) {
+      return false;
+    }
+    bool same = true;
+    m->forEach([&](MALType key, MALType value) {
+      auto other = n->get(key);
+      same = same && other && equals(value, *other);
+    });
+    return same;
+  }
+  case ObjType::Symbol:
+    return static_cast<MALSymbol *>(x)->symbol ==
+           static_cast<MALSymbol *>(y)->symbol;
+  case ObjType::Keyword:
+    return static_cast<MALKeyword *>(x)->keyword ==
+           static_cast<MALKeyword *>(y)->keyword;
+  case ObjType::String:
+    return static_cast<MALString *>(x)->str == static_cast<MALString *>(y)->str;
+  case ObjType::Int:
+    return static_cast<MALInt *>(x)->value == static_cast<MALInt *>(y)->value;
+  case ObjType::List:
+  case ObjType::Vector:
+  case ObjType::CFunc:
+  case ObjType::VecNode:
+  case ObjType::MapNode:
+  case ObjType::Proto:
+  case ObjType::Closure:
+  case ObjType::Upvalue:
+    break;
+  }
+  return false;
+}
 
-MALCFunc::operator std::string() const { return name; }
+// Finalizer from MurmurHash3, to spread the bits of cheap hashes.
+static inline uint32_t mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return (uint32_t)h;
+}
 
-MALError::operator std::string() const { return msg; }
+static inline uint32_t hashString(std::string_view str, ObjType type) {
+  return mix(std::hash<std::string_view>{}(str) + (uint64_t)type);
+}
 
-struct StringVisitor {
-  std::string operator()(std::monostate) { return "nil"; }
-  std::string operator()(bool b) { return b ? "true" : "false"; }
-  std::string operator()(int n) { return std::to_string(n); }
-  std::string operator()(double x) { return std::to_string(x); }
-  std::string operator()(std::shared_ptr<CallFrame>) {
-    assert(false);
-    return "";
+uint32_t hashValue(MALType m) {
+  if (m.isDouble() && m.asDouble() == 0) {
+    // 0.0 and -0.0 are equal.
+    return mix(0);
   }
-
-  template <typename T> std::string operator()(std::shared_ptr<T> t) {
-    return *t;
+  if (!m.isObj()) {
+    return mix(m.bits);
   }
-};
-
-MALType::operator std::string() const {
-  return std::visit(StringVisitor{}, data);
+  auto obj = m.asObj();
+  switch (obj->type) {
+  case ObjType::List:
+  case ObjType::Vector: {
+    // Lists and vectors with equal elements are equal, so hash alike.
+    uint32_t h = 1;
+    for (auto &e : visit(Iterator{}, m)) {
+      h = 31 * h + hashValue(e);
+    }
+    return h;
+  }
+  case ObjType::Map: {
+    // Independent of the order of the entries.
+    uint32_t h = 0;
+    static_cast<MALMap *>(obj)->forEach([&](MALType key, MALType value) {
+      h += hashValue(key) ^ mix(hashValue(value));
+    });
+    return h;
+  }
+  case ObjType::Symbol:
+    return hashString(static_cast<MALSymbol *>(obj)->symbol, obj->type);
+  case ObjType::Keyword:
+    return hashString(static_cast<MALKeyword *>(obj)->keyword, obj->type);
+  case ObjType::String:
+    return hashString(static_cast<MALString *>(obj)->str, obj->type);
+  case ObjType::Int:
+    return mix((uint64_t) static_cast<MALInt *>(obj)->value);
+  case ObjType::MapNode:
+  case ObjType::VecNode:
+  case ObjType::CFunc:
+  case ObjType::Proto:
+  case ObjType::Closure:
+  case ObjType::Upvalue:
+    break;
+  }
+  return mix(m.bits);
 }
@@ -3,7 +3,11 @@
 #include "mal.hpp"
 
 #include <array>
+#include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <memory>
 #include <string>
 #include <unordered_map>
@@ -12,81 +16,429 @@
 
 #include "bytecode.hpp"
 
-struct MALType;
-
 typedef std::monostate MALNil;
 
-struct MALList {
-  MALList() : data(){};
-  MALList(size_t n) : data() { data.reserve(n); };
-  operator std::string();
+#define OBJECT_BUILDER(X, sep)                                                 \
+  X(List, MALList)                                                             \
+  sep X(Vector, MALVector)                                                     \
+  sep X(VecNode, MALVecNode)                                                   \
+  sep X(Map, MALMap)                                                           \
+  sep X(MapNode, MALMapNode)                                                   \
+  sep X(Symbol, MALSymbol)                                                     \
+  sep X(Keyword, MALKeyword)                                                   \
+  sep X(String, MALString)                                                     \
+  sep X(CFunc, MALCFunc)                                                       \
+  sep X(Proto, MALProto)                                                       \
+  sep X(Closure, MALClosure)                                                   \
+  sep X(Upvalue, MALUpvalue)                                                   \
+  sep X(Int, MALInt)
+
+#define BUILD_OBJTYPES(type, _) type
+enum class ObjType : uint8_t { OBJECT_BUILDER(BUILD_OBJTYPES, COMMA) };
+
+// Common header of every heap allocated value. Objects are linked together so
+// that the owning Heap can find them again when sweeping.
+struct MALObject {
+  MALObject(ObjType type) : type(type), marked(false), next(nullptr){};
+
+  ObjType type;
+  bool marked;
+  MALObject *next;
+};
+
+// A NaN-boxed value. Doubles are stored as themselves; everything else lives
+// in the payload of a quiet NaN.
+//
+//   object:  1 11111111111 11 00 <48 bit pointer>
+//   int:     0 11111111111 11 01 <48 bit signed integer>
+//   nil etc: 0 11111111111 11 00 <tag>
+//
+// Integers are 64 bits. Those that don't fit in the payload are boxed in a
+// MALInt, and only those, so each integer has a single representation.
+struct MALType {
+  MALType() : bits(NIL_VAL){};
+  MALType(bool b) : bits(b ? TRUE_VAL : FALSE_VAL){};
+  MALType(int n) : MALType((int64_t)n){};
+  MALType(int64_t n) : bits(QNAN | TAG_INT | ((uint64_t)n & PAYLOAD)) {
+    assert(fitsInline(n));
+  };
+  MALType(double x) {
+    if (x != x) {
+      // Canonicalize NaNs so that they can't be mistaken for a boxed value.
+      bits = CANONICAL_NAN;
+      return;
+    }
+    std::memcpy(&bits, &x, sizeof(x));
+  };
+  MALType(MALObject *obj) : bits(SIGN | QNAN | (uint64_t)(uintptr_t)obj) {
+    assert(((uint64_t)(uintptr_t)obj & ~PAYLOAD) == 0);
+  };
+
+  // Placeholder for global slots that have been allocated but not yet
+  // defined. It never escapes into user visible values.
+  static inline MALType undefined() {
+    MALType m;
+    m.bits = UNDEF_VAL;
+    return m;
+  };
+
+  operator std::string() const;
+
+  static inline bool fitsInline(int64_t n) {
+    return n >= MIN_INLINE_INT && n <= MAX_INLINE_INT;
+  };
+
+  inline bool isNil() const { return bits == NIL_VAL; };
+  inline bool isUndefined() const { return bits == UNDEF_VAL; };
+  inline bool isBool() const { return (bits | 1) == TRUE_VAL; };
+  inline bool isInt() const { return (bits & TAG_MASK) == (QNAN | TAG_INT); };
+  inline bool isDouble() const { return (bits & QNAN) != QNAN; };
+  inline bool isObj() const { return (bits & TAG_MASK) == (SIGN | QNAN); };
+
+  // Only nil and false are falsy.
+  inline bool isTruthy() const { return bits != NIL_VAL && bits != FALSE_VAL; };
+
+  inline bool asBool() const { return bits == TRUE_VAL; };
+  inline int64_t asInt() const {
+    return (int64_t)(bits << (64 - PAYLOAD_BITS)) >> (64 - PAYLOAD_BITS);
+  };
+  inline double asDouble() const {
+    double x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+  };
+  inline MALObject *asObj() const {
+    return (MALObject *)(uintptr_t)(bits & PAYLOAD);
+  };
+
+  // Returns the object if this value holds a T, otherwise nullptr.
+  template <typename T> inline T *as() const {
+    if (isObj() && asObj()->type == T::TYPE) {
+      return static_cast<T *>(asObj());
+    }
+    return nullptr;
+  }
+
+  uint64_t bits;
+
+private:
+  static constexpr int PAYLOAD_BITS = 48;
+  static constexpr uint64_t PAYLOAD = (1ull << PAYLOAD_BITS) - 1;
+  static constexpr int64_t MAX_INLINE_INT = (1ll << (PAYLOAD_BITS - 1)) - 1;
+  static constexpr int64_t MIN_INLINE_INT = -MAX_INLINE_INT - 1;
+  static constexpr uint64_t SIGN = 0x8000000000000000;
+  static constexpr uint64_t QNAN = 0x7ffc000000000000;
+  static constexpr uint64_t TAG_INT = 0x0001000000000000;
+  static constexpr uint64_t TAG_MASK = SIGN | QNAN | 0x0003000000000000;
+  static constexpr uint64_t CANONICAL_NAN = 0x7ff8000000000000;
+
+  static constexpr uint64_t NIL_VAL = QNAN | 1;
+  static constexpr uint64_t FALSE_VAL = QNAN | 2;
+  static constexpr uint64_t TRUE_VAL = QNAN | 3;
+  static constexpr uint64_t UNDEF_VAL = QNAN | 4;
+};
+static_assert(sizeof(MALType) == 8, "MALType is an unexpected size");
+
+struct Heap;
+struct MALList;
+struct MALVector;
 
-  inline auto begin() { return data.begin(); };
-  inline auto begin() const { return data.begin(); };
-  inline auto end() { return data.end(); };
-  inline auto end() const { return data.end(); };
-  inline auto empty() const { return data.empty(); };
-  inline auto size() const { return data.size(); };
+// Iterates over the elements of a list or a vector. Lists are walked one cell
+// at a time, vectors one leaf at a time, so most steps are a pointer increment.
+struct SeqIterator {
+  using iterator_category = std::forward_iterator_tag;
+  using value_type = MALType;
+  using difference_type = ptrdiff_t;
+  using pointer = const MALType *;
+  using reference = const MALType &;
 
-  std::vector<MALType> data;
+  SeqIterator(const MALType *ptr, const MALType *leafEnd, const MALVector *vec,
+              size_t index)
+      : ptr(ptr), leafEnd(leafEnd), vec(vec), cell(nullptr), index(index){};
+  SeqIterator(const MALList *cell, size_t index);
+
+  inline const MALType &operator*() const { return *ptr; };
+  inline const MALType *operator->() const { return ptr; };
+  inline SeqIterator &operator++() {
+    index++;
+    if (cell) {
+      nextCell();
+    } else if (++ptr == leafEnd && vec) {
+      nextLeaf();
+    }
+    return *this;
+  };
+  inline SeqIterator operator++(int) {
+    auto ret = *this;
+    ++*this;
+    return ret;
+  };
+  inline bool operator==(const SeqIterator &o) const {
+    return index == o.index;
+  };
+  inline bool operator!=(const SeqIterator &o) const {
+    return index != o.index;
+  };
+
+  const MALType *ptr;
+  const MALType *leafEnd;
+  const MALVector *vec; // Set when iterating a vector.
+  const MALList *cell;  // Set when iterating a list.
+  size_t index;
+
+private:
+  void nextLeaf();
+  inline void nextCell();
 };
 
-struct MALVector {
-  MALVector() : data(){};
-  MALVector(size_t n) : data() { data.reserve(n); };
-  operator std::string();
+// An immutable singly linked list. Every cell caches the length of the list it
+// starts, so count is O(1), and cons and rest share all but the first cell.
+// The empty list is a cell with cnt 0; the last cell of any other list has a
+// null rest.
+struct MALList : MALObject {
+  static constexpr ObjType TYPE = ObjType::List;
 
-  inline auto begin() { return data.begin(); };
-  inline auto begin() const { return data.begin(); };
-  inline auto end() { return data.end(); };
-  inline auto end() const { return data.end(); };
-  inline auto empty() const { return data.empty(); };
-  inline auto size() const { return data.size(); };
-  inline const MALType &operator[](size_t n) const { return data[n]; };
-  inline MALType &operator[](size_t n) { return data[n]; };
+  MALList() : MALObject(TYPE), first(), rest(nullptr), cnt(0){};
+  MALList(MALType first, MALList *rest)
+      : MALObject(TYPE), first(first), rest(rest),
+        cnt(rest ? rest->cnt + 1 : 1){};
+
+  inline SeqIterator begin() const {
+    return SeqIterator(cnt ? this : nullptr, 0);
+  };
+  inline SeqIterator end() const { return SeqIterator(nullptr, cnt); };
+  inline bool empty() const { return cnt == 0; };
+  inline size_t size() const { return cnt; };
 
-  std::vector<MALType> data;
+  // Returns m followed by the elements of this list.
+  MALList *cons(Heap &heap, MALType m);
+  // A is the Heap, or the Arena the reader builds forms in.
+  template <typename A>
+  static MALList *from(A &alloc, const MALType *begin, const MALType *end);
+
+  MALType first;
+  MALList *rest;
+  size_t cnt;
 };
 
-struct MALMap {
-  MALMap() : data(){};
-  MALMap(size_t n) : data() { data.reserve(n); };
-  operator std::string();
+inline SeqIterator::SeqIterator(const MALList *cell, size_t index)
+    : ptr(cell ? &cell->first : nullptr), leafEnd(nullptr), vec(nullptr),
+      cell(cell), index(index) {}
+
+inline void SeqIterator::nextCell() {
+  cell = cell->rest;
+  ptr = cell ? &cell->first : nullptr;
+}
+
+// A node of a vector's trie. Leaves hold elements, inner nodes hold their
+// children boxed as MALTypes, with nil for children that don't exist yet.
+struct MALVecNode : MALObject {
+  static constexpr ObjType TYPE = ObjType::VecNode;
+  static constexpr size_t WIDTH = 32;
 
-  std::unordered_map<std::string, MALType> data;
+  MALVecNode() : MALObject(TYPE), slots(){};
+  MALVecNode(const MALVecNode &n) : MALObject(TYPE), slots(n.slots){};
+
+  std::array<MALType, WIDTH> slots;
 };
 
-struct MALSymbol {
-  MALSymbol(const char *ptr, int len) : symbol(ptr, ptr + len){};
-  MALSymbol(const std::string &symbol) : symbol(symbol){};
-  operator std::string() const;
+// A persistent vector in the style of Clojure's: a 32-way trie of full leaves
+// plus a tail of up to 32 elements that appends go to. Updates copy the path
+// to the changed leaf and share everything else with the original, so they
+// are O(log32 n). Vectors are never modified once they have been built.
+struct MALVector : MALObject {
+  static constexpr ObjType TYPE = ObjType::Vector;
+  static constexpr unsigned BITS = 5;
+  static constexpr size_t WIDTH = MALVecNode::WIDTH;
+  static constexpr size_t MASK = WIDTH - 1;
+  static_assert(WIDTH == 1 << BITS, "MALVecNode has an unexpected width");
+
+  MALVector() : MALObject(TYPE), cnt(0), shift(BITS), root(nullptr), tail(){};
+
+  SeqIterator begin() const;
+  inline SeqIterator end() const {
+    return SeqIterator(nullptr, nullptr, this, cnt);
+  };
+  inline bool empty() const { return cnt == 0; };
+  inline size_t size() const { return cnt; };
+  inline const MALType &operator[](size_t i) const {
+    return leafFor(i)[i & MASK];
+  };
+
+  MALVector *conj(Heap &heap, MALType m) const;
+  // i may be size(), which appends.
+  MALVector *assoc(Heap &heap, size_t i, MALType m) const;
+  // Builds the trie directly, rather than through a series of conj calls. A is
+  // the Heap, or the Arena the reader builds forms in.
+  template <typename A>
+  static MALVector *from(A &alloc, const MALType *begin, const MALType *end);
+
+  // The leaf array holding element i.
+  const MALType *leafFor(size_t i) const;
+  // Index of the first element in the tail.
+  inline size_t tailOffset() const {
+    return cnt < WIDTH ? 0 : ((cnt - 1) >> BITS) << BITS;
+  };
+
+  size_t cnt;
+  unsigned shift; // Level of the root; leaves are at level 0.
+  MALVecNode *root;
+  std::vector<MALType> tail;
+};
+
+// A node of a map's hash trie, laid out as in CHAMP: the key value pairs of
+// the entries stored inline come first, followed by the child nodes. datamap
+// and nodemap say which of the 32 hash fragments at this level are used by
+// each. Keys whose hashes are equal in every bit end up together in a
+// collision node below the last level, which only holds pairs.
+struct MALMapNode : MALObject {
+  static constexpr ObjType TYPE = ObjType::MapNode;
+
+  MALMapNode() : MALObject(TYPE), datamap(0), nodemap(0), slots(){};
+  MALMapNode(const MALMapNode &n)
+      : MALObject(TYPE), datamap(n.datamap), nodemap(n.nodemap),
+        slots(n.slots){};
+
+  uint32_t datamap;
+  uint32_t nodemap;
+  std::vector<MALType> slots;
+};
+
+// A persistent hash map: a hash array mapped trie keyed by any MALType, using
+// the same notion of equality as =. Updates copy the path to the changed node
+// and share everything else.
+struct MALMap : MALObject {
+  static constexpr ObjType TYPE = ObjType::Map;
+
+  MALMap() : MALObject(TYPE), cnt(0), root(nullptr){};
+
+  inline size_t size() const { return cnt; };
+  inline bool empty() const { return cnt == 0; };
+
+  // Returns the value for key, or nullptr if there is none.
+  const MALType *get(MALType key) const;
+  MALMap *assoc(Heap &heap, MALType key, MALType value) const;
+  MALMap *dissoc(Heap &heap, MALType key) const;
+
+  // Calls f(key, value) for every entry.
+  template <typename F> void forEach(F &&f) const {
+    if (root) {
+      forEach(root, 0, f);
+    }
+  }
+
+  size_t cnt;
+  MALMapNode *root;
+
+private:
+  template <typename F>
+  static void forEach(const MALMapNode *node, unsigned shift, F &f);
+};
+
+struct MALSymbol : MALObject {
+  static constexpr ObjType TYPE = ObjType::Symbol;
+
+  MALSymbol(const char *ptr, int len)
+      : MALObject(TYPE), symbol(ptr, ptr + len){};
+  MALSymbol(const std::string &symbol) : MALObject(TYPE), symbol(symbol){};
 
   std::string symbol;
 };
 
-struct MALKeyword {
-  MALKeyword(const char *ptr, int len) : keyword(ptr, ptr + len){};
-  MALKeyword(const std::string &keyword) : keyword(keyword){};
-  operator std::string() const;
+// An integer too large to store inline.
+struct MALInt : MALObject {
+  static constexpr ObjType TYPE = ObjType::Int;
+
+  MALInt(int64_t value) : MALObject(TYPE), value(value) {
+    assert(!MALType::fitsInline(value));
+  };
+
+  const int64_t value;
+};
+
+// Whether m is an integer, inline or boxed, and if so its value.
+inline bool toInt(MALType m, int64_t &n) {
+  if (m.isInt()) {
+    n = m.asInt();
+    return true;
+  }
+  if (auto boxed = m.as<MALInt>()) {
+    n = boxed->value;
+    return true;
+  }
+  return false;
+}
+
+struct MALKeyword : MALObject {
+  static constexpr ObjType TYPE = ObjType::Keyword;
+
+  MALKeyword(const char *ptr, int len)
+      : MALObject(TYPE), keyword(ptr, ptr + len){};
+  MALKeyword(const std::string &keyword) : MALObject(TYPE), keyword(keyword){};
 
   std::string keyword;
 };
 
-struct MALString {
-  MALString(const std::string &str) : str(str){};
-  MALString(const char *ptr, int len) : str(ptr, ptr + len){};
+struct MALString : MALObject {
+  static constexpr ObjType TYPE = ObjType::String;
+
+  MALString(const std::string &str) : MALObject(TYPE), str(str){};
+  MALString(const char *ptr, int len) : MALObject(TYPE), str(ptr, ptr + len){};
 
-  operator std::string() const;
   std::string str;
 };
 
-struct MALCFunc {
-  MALCFunc(CFunction fn, std::string_view name) : fn(fn), name(name){};
+// Builtins with a dedicated opcode. The compiler emits the opcode instead of a
+// CALL when a two argument call's head resolves to such a builtin.
+enum class BinOp : uint8_t { None, Add, Sub, Mul, Div, Lt, Le, Gt, Ge, Eq };
 
-  operator std::string() const;
+struct MALCFunc : MALObject {
+  static constexpr ObjType TYPE = ObjType::CFunc;
+
+  MALCFunc(CFunction fn, std::string_view name, BinOp binop = BinOp::None)
+      : MALObject(TYPE), fn(fn), name(name), binop(binop){};
 
   CFunction fn;
   std::string name;
+  BinOp binop;
+};
+
+struct Chunk;
+
+// The compiled body of a fn*. Closures created from it share the chunk.
+struct MALProto : MALObject {
+  static constexpr ObjType TYPE = ObjType::Proto;
+
+  MALProto(std::unique_ptr<Chunk> chunk);
+  ~MALProto();
+
+  std::unique_ptr<Chunk> chunk;
+};
+
+// A variable captured by a closure. While the variable's register is still
+// live the upvalue is open and v points into the stack; once the register goes
+// out of scope the value is copied into closed and v points there instead.
+struct MALUpvalue : MALObject {
+  static constexpr ObjType TYPE = ObjType::Upvalue;
+
+  MALUpvalue(MALType *v, ptrdiff_t slot)
+      : MALObject(TYPE), v(v), closed(), slot(slot), nextOpen(nullptr){};
+
+  MALType *v;
+  MALType closed;
+  // Index of the register in the stack, used while open.
+  ptrdiff_t slot;
+  // Open upvalues are kept in a list sorted by slot, highest first.
+  MALUpvalue *nextOpen;
+};
+
+struct MALClosure : MALObject {
+  static constexpr ObjType TYPE = ObjType::Closure;
+
+  MALClosure(MALProto *proto) : MALObject(TYPE), proto(proto), upvalues(){};
+
+  MALProto *proto;
+  std::vector<MALUpvalue *> upvalues;
 };
 
 struct MALError {
@@ -95,56 +447,84 @@ struct MALError {
 
   operator std::string() const;
   std::string msg;
+  std::string location; // The file and line it was raised at, if known.
 };
 
-struct CallFrame;
+// Structural equality as used by =.
+bool equals(MALType a, MALType b);
+// A hash consistent with equals.
+uint32_t hashValue(MALType m);
 
-struct MALType {
-  operator std::string() const;
+inline unsigned popcount(uint32_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+  return (unsigned)__builtin_popcount(x);
+#else
+  unsigned n = 0;
+  for (; x; x &= x - 1) {
+    n++;
+  }
+  return n;
+#endif
+}
 
-  std::variant<MALNil, bool, int, double, std::shared_ptr<MALList>,
-               std::shared_ptr<MALVector>, std::shared_ptr<MALMap>,
-               std::shared_ptr<MALSymbol>, std::shared_ptr<MALKeyword>,
-               std::shared_ptr<MALString>, std::shared_ptr<MALCFunc>,
-               std::shared_ptr<CallFrame>>
-      data;
-};
+// Bits of the hash used by each level of a map's trie.
+static constexpr unsigned HAMT_BITS = 5;
+static constexpr unsigned HASH_BITS = 32;
 
-struct Iterator {
-  template <typename T> std::array<const MALType *, 2> operator()(T &) {
-    return {nullptr, nullptr};
+template <typename F>
+void MALMap::forEach(const MALMapNode *node, unsigned shift, F &f) {
+  auto pairs = shift >= HASH_BITS ? node->slots.size() / 2
+                                  : (size_t)popcount(node->datamap);
+  for (size_t i = 0; i < pairs; i++) {
+    f(node->slots[2 * i], node->slots[2 * i + 1]);
   }
-  std::array<const MALType *, 2> operator()(std::shared_ptr<MALVector> &v) {
-    const auto &v2 = v;
-    return (*this)(v2);
+  for (size_t i = 2 * pairs; i < node->slots.size(); i++) {
+    forEach(static_cast<const MALMapNode *>(node->slots[i].asObj()),
+            shift + HAMT_BITS, f);
   }
-  std::array<const MALType *, 2>
-  operator()(const std::shared_ptr<MALVector> &v) {
-    if (v->empty()) {
-      // we check for nullptr to see if something isn't sequenceable. We want an
-      // empty vector to actually point to something.
-      return {&self, &self};
-    }
-    return {&(*v->begin()), &(*v->end())};
-  };
-  std::array<const MALType *, 2> operator()(std::shared_ptr<MALList> &l) {
-    const auto &l2 = l;
-    return (*this)(l2);
+}
+
+// Calls v with the unboxed contents of m: MALNil, bool, int64_t, double or a
+// pointer to the concrete object type.
+#define BUILD_VISIT_CASE(type, T)                                              \
+  case ObjType::type:                                                          \
+    return v(static_cast<T *>(obj))
+
+template <typename V> inline decltype(auto) visit(V &&v, const MALType &m) {
+  if (m.isDouble()) {
+    return v(m.asDouble());
   }
-  std::array<const MALType *, 2> operator()(const std::shared_ptr<MALList> &l) {
-    if (l->empty()) {
-      // we check for nullptr to see if something isn't sequenceable. We want an
-      // empty vector to actually point to something.
-      return {&self, &self};
-    }
-    return {&(*l->begin()), &(*l->end())};
-  };
+  if (m.isInt()) {
+    return v(m.asInt());
+  }
+  if (m.isObj()) {
+    auto obj = m.asObj();
+    switch (obj->type) { OBJECT_BUILDER(BUILD_VISIT_CASE, ;); }
+  }
+  if (m.isBool()) {
+    return v(m.asBool());
+  }
+  assert(m.isNil());
+  return v(MALNil{});
+}
 
-  const MALType &self;
+// The elements of a list or vector. valid is false if the value wasn't one.
+struct Seq {
+  inline SeqIterator begin() const { return first; };
+  inline SeqIterator end() const { return last; };
+  inline size_t size() const { return last.index - first.index; };
+  inline bool empty() const { return first == last; };
+
+  SeqIterator first;
+  SeqIterator last;
+  bool valid;
 };
 
-struct CallFrame {
-  MALType fn;
-  std::vector<byteCode>::const_iterator parent_ip;
-  ptrdiff_t stack_offset;
+struct Iterator {
+  template <typename T> Seq operator()(T) {
+    auto none = SeqIterator(nullptr, nullptr, nullptr, 0);
+    return {none, none, false};
+  }
+  Seq operator()(MALVector *v) { return {v->begin(), v->end(), true}; };
+  Seq operator()(MALList *l) { return {l->begin(), l->end(), true}; };
 };
@@ -0,0 +1,170 @@
+#include "arena.hpp"
+#include "heap.hpp"
+#include "types.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+static inline MALVecNode *child(const MALVecNode *node, size_t i) {
+  auto m = node->slots[i];
+  return m.isNil() ? nullptr : static_cast<MALVecNode *>(m.asObj());
+}
+
+void SeqIterator::nextLeaf() {
+  if (index >= vec->size()) {
+    return;
+  }
+  ptr = vec->leafFor(index);
+  leafEnd = ptr + std::min(MALVector::WIDTH, vec->size() - index);
+}
+
+SeqIterator MALVector::begin() const {
+  if (cnt == 0) {
+    return end();
+  }
+  auto leaf = leafFor(0);
+  return SeqIterator(leaf, leaf + std::min(WIDTH, cnt), this, 0);
+}
+
+const MALType *MALVector::leafFor(size_t i) const {
+  assert(i < cnt);
+  if (i >= tailOffset()) {
+    return tail.data();
+  }
+  auto node = root;
+  for (auto level = shift; level > 0; level -= BITS) {
+    node = child(node, (i >> level) & MASK);
+  }
+  return node->slots.data();
+}
+
+// Returns a path of new nodes from level down to leaf.
+static MALVecNode *newPath(Heap &heap, unsigned level, MALVecNode *leaf) {
+  if (level == 0) {
+    return leaf;
+  }
+  auto node = heap.alloc<MALVecNode>();
+  node->slots[0] = MALType{newPath(heap, level - MALVector::BITS, leaf)};
+  return node;
+}
+
+// Returns a copy of parent with leaf added as the last leaf below it. cnt is
+// the number of elements in the vector before the tail is pushed.
+static MALVecNode *pushTail(Heap &heap, size_t cnt, unsigned level,
+                            const MALVecNode *parent, MALVecNode *leaf) {
+  auto node = parent ? heap.alloc<MALVecNode>(*parent)
+                     : heap.alloc<MALVecNode>();
+  auto i = ((cnt - 1) >> level) & MALVector::MASK;
+  MALVecNode *insert;
+  if (level == MALVector::BITS) {
+    insert = leaf;
+  } else if (auto next = parent ? child(parent, i) : nullptr) {
+    insert = pushTail(heap, cnt, level - MALVector::BITS, next, leaf);
+  } else {
+    insert = newPath(heap, level - MALVector::BITS, leaf);
+  }
+  node->slots[i] = MALType{insert};
+  return node;
+}
+
+MALVector *MALVector::conj(Heap &heap, MALType m) const {
+  auto ret = heap.alloc<MALVector>();
+  ret->cnt = cnt + 1;
+  ret->shift = shift;
+  ret->root = root;
+  if (cnt - tailOffset() < WIDTH) {
+    ret->tail.reserve(tail.size() + 1);
+    ret->tail = tail;
+    ret->tail.push_back(m);
+    return ret;
+  }
+
+  // The tail is full, so it becomes a leaf of the trie.
+  auto leaf = heap.alloc<MALVecNode>();
+  std::copy(tail.begin(), tail.end(), leaf->slots.begin());
+  if ((cnt >> BITS) > ((size_t)1 << shift)) {
+    // The trie is full as well, so it grows a level.
+    auto newRoot = heap.alloc<MALVecNode>();
+    newRoot->slots[0] = MALType{root};
+    newRoot->slots[1] = MALType{newPath(heap, shift, leaf)};
+    ret->root = newRoot;
+    ret->shift = shift + BITS;
+  } else {
+    ret->root = pushTail(heap, cnt, shift, root, leaf);
+  }
+  ret->tail.push_back(m);
+  return ret;
+}
+
+static MALVecNode *assocPath(Heap &heap, unsigned level, const MALVecNode *node,
+                             size_t i, MALType m) {
+  auto ret = heap.alloc<MALVecNode>(*node);
+  if (level == 0) {
+    ret->slots[i & MALVector::MASK] = m;
+  } else {
+    auto sub = (i >> level) & MALVector::MASK;
+    ret->slots[sub] = MALType{
+        assocPath(heap, level - MALVector::BITS, child(node, sub), i, m)};
+  }
+  return ret;
+}
+
+MALVector *MALVector::assoc(Heap &heap, size_t i, MALType m) const {
+  assert(i <= cnt);
+  if (i == cnt) {
+    return conj(heap, m);
+  }
+  auto ret = heap.alloc<MALVector>();
+  ret->cnt = cnt;
+  ret->shift = shift;
+  if (i >= tailOffset()) {
+    ret->root = root;
+    ret->tail = tail;
+    ret->tail[i & MASK] = m;
+  } else {
+    ret->root = assocPath(heap, shift, root, i, m);
+    ret->tail = tail;
+  }
+  return ret;
+}
+
+template <typename A>
+MALVector *MALVector::from(A &alloc, const MALType *begin,
+                           const MALType *end) {
+  auto ret = alloc.template alloc<MALVector>();
+  ret->cnt = (size_t)(end - begin);
+  auto tailStart = begin + ret->tailOffset();
+  ret->tail.assign(tailStart, end);
+  if (tailStart == begin) {
+    return ret;
+  }
+
+  // Build the trie bottom up: first the leaves, then each level of parents
+  // until a single node is left.
+  std::vector<MALVecNode *> level;
+  for (auto it = begin; it != tailStart; it += WIDTH) {
+    auto leaf = alloc.template alloc<MALVecNode>();
+    std::copy(it, it + WIDTH, leaf->slots.begin());
+    level.push_back(leaf);
+  }
+  do {
+    std::vector<MALVecNode *> parents;
+    for (size_t i = 0; i < level.size(); i += WIDTH) {
+      auto node = alloc.template alloc<MALVecNode>();
+      for (size_t j = 0; j < WIDTH && i + j < level.size(); j++) {
+        node->slots[j] = MALType{level[i + j]};
+      }
+      parents.push_back(node);
+    }
+    level = std::move(parents);
+    if (level.size() > 1) {
+      ret->shift += BITS;
+    }
+  } while (level.size() > 1);
+  ret->root = level[0];
+  return ret;
+}
+
+template MALVector *MALVector::from(Heap &, const MALType *, const MALType *);
+template MALVector *MALVector::from(Arena &, const MALType *, const MALType *);
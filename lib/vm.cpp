@@ -1,3 +1,6 @@
+#include "arith.hpp"
+#include "instrument.hpp"
+#include "profiler.hpp"
 #include "state.hpp"
 #include "types.hpp"
 
@@ -7,80 +10,330 @@
 #include "debug.hpp"
 #endif
 
+#include <algorithm>
 #include <cassert>
 #include <memory>
+#include <string>
+
+// With labels-as-values every opcode handler ends in its own indirect jump to
+// the next handler, which the branch predictor can learn per opcode. The
+// switch is kept as a portable fallback; both are driven by the same macros so
+// that handlers are only written once.
+#if defined(MAL_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define THREADED_DISPATCH
+#endif
+
+// Takes a profiling sample if the timer has ticked. This is checked at calls
+// and returns, where the frames are consistent.
+#define PROFILE_POINT()                                                        \
+  if (Profiler::ticks.load(std::memory_order_relaxed)) {                       \
+    profiler.sample(frames);                                                   \
+  }
+
+#define COUNT_INSTRUCTION()                                                    \
+  INSTRUMENT(stats.count(instruction.op(), heap.allocations))
+
+#ifdef THREADED_DISPATCH
+#define BUILD_LABELS(op, _) &&op_##op
+#define DISPATCH()                                                             \
+  instruction = *ip++;                                                         \
+  COUNT_INSTRUCTION();                                                         \
+  goto *dispatchTable[(size_t)instruction.op()]
+#define vmdispatch(o) DISPATCH();
+#define vmcase(op) op_##op:
+#define vmbreak DISPATCH()
+#else
+#define vmdispatch(o) switch (o)
+#define vmcase(op) case opCode::op:
+#define vmbreak break
+#endif
+
+#define BINOP(opname, op, rhs)                                                 \
+  vmcase(opname) {                                                             \
+    assert(stackTop + instruction.regA() <= stack.end());                      \
+    assert(stackTop + instruction.regB() <= stack.end());                      \
+    if (auto err = binop<BinOp::op>(heap, stackTop[instruction.regB()], rhs,   \
+                                    stackTop[instruction.regA()])) {           \
+      error = std::make_shared<MALError>(err);                                 \
+      goto unwind;                                                             \
+    }                                                                          \
+    /* Integers too large to store inline are boxed. */                        \
+    if (stackTop[instruction.regA()].isObj() && heap.shouldCollect()) {        \
+      collectGarbage();                                                        \
+    }                                                                          \
+    vmbreak;                                                                   \
+  }
+#define BINOP_RR(opname, op) BINOP(opname, op, stackTop[instruction.regC()])
+#define BINOP_RK(opname, op)                                                   \
+  BINOP(opname, op, chunk->constants[instruction.regC()])
+
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+bool MALState::State::growStack(size_t n) {
+  auto top = (size_t)(stackTop - stack.begin());
+  if (top + n > maxStack) {
+    error = std::make_shared<MALError>("Stack overflow");
+    return false;
+  }
+  stack.resize(std::min(std::max(stack.size() * 2, top + n), maxStack));
+  // Resizing invalidated stackTop and the open upvalues. Everything else
+  // refers to the stack by offset.
+  stackTop = stack.begin() + (ptrdiff_t)top;
+  for (auto uv = openUpvalues; uv; uv = uv->nextOpen) {
+    uv->v = &stack[(size_t)uv->slot];
+  }
+  return true;
+}
+
+// Returns the open upvalue for the register at slot, creating it if this is
+// the first closure to capture it, so that closures share captured variables.
+MALUpvalue *MALState::State::findUpvalue(ptrdiff_t slot) {
+  auto link = &openUpvalues;
+  while (*link && (*link)->slot > slot) {
+    link = &(*link)->nextOpen;
+  }
+  if (*link && (*link)->slot == slot) {
+    return *link;
+  }
+  auto uv = heap.alloc<MALUpvalue>(&stack[(size_t)slot], slot);
+  uv->nextOpen = *link;
+  *link = uv;
+  return uv;
+}
+
+// Closes the upvalues of all registers from level up, as they are about to go
+// out of scope.
+void MALState::State::closeUpvalues(ptrdiff_t level) {
+  while (openUpvalues && openUpvalues->slot >= level) {
+    auto uv = openUpvalues;
+    uv->closed = *uv->v;
+    uv->v = &uv->closed;
+    openUpvalues = uv->nextOpen;
+    uv->nextOpen = nullptr;
+  }
+}
+
+// Sets up the registers of a closure whose nargs arguments start at stackTop.
+bool MALState::State::enterClosure(const MALClosure &cl, size_t nargs) {
+  auto &proto = *cl.proto->chunk;
+  if (nargs < proto.numParams || (!proto.variadic && nargs > proto.numParams)) {
+    error = std::make_shared<MALError>("Wrong number of arguments");
+    return false;
+  }
+  if (!ensureStack(std::max<size_t>(proto.frameSize, nargs))) {
+    return false;
+  }
+  if (proto.variadic) {
+    auto args = &*stackTop;
+    auto rest = MALList::from(heap, args + proto.numParams, args + nargs);
+    stackTop[proto.numParams] = MALType{rest};
+  }
+  return true;
+}
+
+// Calls a C function with its nargs arguments at stackTop.
+inline bool MALState::State::callCFunc(const MALCFunc &fn, size_t nargs) {
+#ifdef MAL_INSTRUMENT
+  auto started = VMStats::Clock::now();
+  auto ok = fn.fn(&parent, nargs);
+  stats.cfunc(fn.name, VMStats::Clock::now() - started);
+#else
+  auto ok = fn.fn(&parent, nargs);
+#endif
+  // Charges the time spent in the function to it, while it is still on the
+  // stack.
+  PROFILE_POINT();
+  return ok;
+}
 
 bool MALState::State::eval(int) {
 #ifdef DEBUG
-  disassembleChunk(*chunk);
+  disassembleChunk(*proto->chunk);
+#endif
+
+#ifdef THREADED_DISPATCH
+  static const void *const dispatchTable[] = {
+      OPCODE_BUILDER(BUILD_LABELS, COMMA)};
 #endif
 
-  auto &code = chunk->code;
-  std::vector<byteCode>::const_iterator ip = code.begin();
-  while (ip != code.end()) {
-    auto instruction = *ip;
-    ip++;
-    switch (instruction.op()) {
-    case opCode::CONST:
+  // Where to unwind to if anything fails.
+  auto entryTop = stackTop - stack.begin();
+  auto entryFrames = frames.size();
+
+  // The top level form runs as a closure without upvalues, so that RETURN
+  // treats it like any other frame.
+  auto closure = heap.alloc<MALClosure>(proto);
+  const Chunk *chunk = proto->chunk.get();
+  assert(!chunk->code.empty() && chunk->code.back().op() == opCode::RETURN);
+  const byteCode *ip = chunk->code.data();
+  byteCode instruction;
+  frames.push_back(CallFrame{MALType{closure}, nullptr, entryTop});
+  INSTRUMENT(stats.start(heap.allocations));
+
+  if (!ensureStack(chunk->frameSize)) {
+    goto unwind;
+  }
+
+  for (;;) {
+#ifndef THREADED_DISPATCH
+    instruction = *ip++;
+    COUNT_INSTRUCTION();
+#endif
+    vmdispatch(instruction.op()) {
+    vmcase(CONST)
       assert(stackTop + instruction.regA() <= stack.end());
       assert(instruction.regD() <= chunk->constants.size());
       stackTop[instruction.regA()] = chunk->constants[instruction.regD()];
-      break;
-    case opCode::GLOBAL_GET: {
-      assert(instruction.regD() <= chunk->constants.size());
-      auto &c = chunk->constants[instruction.regD()];
-      auto key = std::get_if<std::shared_ptr<MALString>>(&c.data);
-      assert(key);
-      auto val = globals.data.find(key->get()->str);
-      if (val != globals.data.end()) {
-        assert(stackTop + instruction.regA() <= stack.end());
-        stackTop[instruction.regA()] = val->second;
-      } else {
+      vmbreak;
+    vmcase(GLOBAL_GET)
+      assert(stackTop + instruction.regA() <= stack.end());
+      assert(globals.isDefined(instruction.regD()));
+      stackTop[instruction.regA()] = globals.values[instruction.regD()];
+      vmbreak;
+    vmcase(GLOBAL_GET_CHECK) {
+      assert(stackTop + instruction.regA() <= stack.end());
+      assert(instruction.regD() < globals.values.size());
+      auto val = globals.values[instruction.regD()];
+      if (val.isUndefined()) {
         error = std::make_shared<MALError>("Unknown global variable");
-        return false;
+        goto unwind;
       }
-      break;
-    }
-    case opCode::GLOBAL_SET: {
-      assert(stackTop + instruction.regA() <= stack.end());
-      assert(instruction.regD() <= chunk->constants.size());
-      globals.data[chunk->constants[instruction.regD()]] =
-          stackTop[instruction.regA()];
-      break;
+      stackTop[instruction.regA()] = val;
+      vmbreak;
     }
-    case opCode::NEW_LIST:
+    vmcase(GLOBAL_SET)
       assert(stackTop + instruction.regA() <= stack.end());
-      stackTop[instruction.regA()] =
-          MALType{std::make_shared<MALList>(instruction.regD())};
-      break;
-    case opCode::CALL: {
+      assert(instruction.regD() < globals.values.size());
+      globals.values[instruction.regD()] = stackTop[instruction.regA()];
+      vmbreak;
+    vmcase(NEW_LIST)
       assert(stackTop + instruction.regA() <= stack.end());
-      auto m = stackTop[instruction.regA()];
-      auto cf = std::make_shared<CallFrame>();
-      cf->fn = m;
-      cf->parent_ip = ip;
-      cf->stack_offset = instruction.regA() + 1;
-      auto argCount = instruction.regD();
-      // TODO make this more resilient
-      auto fn = std::get_if<std::shared_ptr<MALCFunc>>(&m.data);
-      assert(fn);
-      stackTop[instruction.regA()] = MALType{cf};
-      stackTop += instruction.regA() + 1;
-      if (!(*fn)->fn(&parent, argCount)) {
+      stackTop[instruction.regA()] = MALType{heap.alloc<MALList>()};
+      if (heap.shouldCollect()) {
+        collectGarbage();
+      }
+      vmbreak;
+    vmcase(CALL) {
+      assert(stackTop + instruction.regA() < stack.end());
+      PROFILE_POINT();
+      auto callee = stackTop + instruction.regA();
+      auto nargs = instruction.regD();
+      if (auto cl = callee->as<MALClosure>()) {
+        frames.push_back(CallFrame{*callee, ip, (callee + 1) - stack.begin()});
+        stackTop = callee + 1;
+        if (!enterClosure(*cl, nargs)) {
+          goto unwind;
+        }
+        closure = cl;
+        chunk = cl->proto->chunk.get();
+        ip = chunk->code.data();
+        vmbreak;
+      }
+      auto fn = callee->as<MALCFunc>();
+      if (!fn) {
+        error = std::make_shared<MALError>("Not a function");
+        goto unwind;
+      }
+      frames.push_back(CallFrame{*callee, ip, (callee + 1) - stack.begin()});
+      stackTop = callee + 1;
+      if (!ensureStack(nargs + MIN_C_STACK)) {
+        goto unwind;
+      }
+      if (!callCFunc(*fn, nargs)) {
+        assert(error);
+        goto unwind;
+      }
+      stackTop[-1] = stackTop[0];
+      stackTop -= instruction.regA() + 1;
+      frames.pop_back();
+      if (heap.shouldCollect()) {
+        collectGarbage();
+      }
+      vmbreak;
+    }
+    vmcase(TAILCALL) {
+      assert(stackTop + instruction.regA() < stack.end());
+      PROFILE_POINT();
+      assert(frames.size() > entryFrames + 1);
+      auto nargs = instruction.regD();
+      closeUpvalues(frames.back().base);
+      // Slide the callee and its arguments down over the current frame.
+      auto callee = stackTop + instruction.regA();
+      std::copy(callee, callee + nargs + 1, stackTop - 1);
+      frames.back().fn = stackTop[-1];
+      if (auto cl = stackTop[-1].as<MALClosure>()) {
+        if (!enterClosure(*cl, nargs)) {
+          goto unwind;
+        }
+        closure = cl;
+        chunk = cl->proto->chunk.get();
+        ip = chunk->code.data();
+        // A loop written as a tail call may never return, so this is its
+        // safe point.
+        if (heap.shouldCollect()) {
+          collectGarbage();
+        }
+        vmbreak;
+      }
+      auto fn = stackTop[-1].as<MALCFunc>();
+      if (!fn) {
+        error = std::make_shared<MALError>("Not a function");
+        goto unwind;
+      }
+      if (!ensureStack(nargs + MIN_C_STACK)) {
+        goto unwind;
+      }
+      if (!callCFunc(*fn, nargs)) {
         assert(error);
-        return false;
+        goto unwind;
       }
       stackTop[-1] = stackTop[0];
-      stackTop -= cf->stack_offset;
-      ip = cf->parent_ip;
-      break;
+      goto returnToCaller;
     }
-    case opCode::MOV:
+    vmcase(JMP)
+      ip += instruction.regSD();
+      vmbreak;
+    vmcase(JMPF)
+      assert(stackTop + instruction.regA() <= stack.end());
+      if (!stackTop[instruction.regA()].isTruthy()) {
+        ip += instruction.regSD();
+      }
+      vmbreak;
+    vmcase(CLOSURE) {
+      assert(stackTop + instruction.regA() <= stack.end());
+      assert(instruction.regD() < chunk->constants.size());
+      auto proto = chunk->constants[instruction.regD()].as<MALProto>();
+      assert(proto);
+      auto cl = heap.alloc<MALClosure>(proto);
+      auto base = stackTop - stack.begin();
+      cl->upvalues.reserve(proto->chunk->upvalues.size());
+      for (auto &desc : proto->chunk->upvalues) {
+        cl->upvalues.push_back(desc.inStack ? findUpvalue(base + desc.index)
+                                            : closure->upvalues[desc.index]);
+      }
+      stackTop[instruction.regA()] = MALType{cl};
+      if (heap.shouldCollect()) {
+        collectGarbage();
+      }
+      vmbreak;
+    }
+    vmcase(GET_UPVAL)
+      assert(stackTop + instruction.regA() <= stack.end());
+      assert(instruction.regD() < closure->upvalues.size());
+      stackTop[instruction.regA()] = *closure->upvalues[instruction.regD()]->v;
+      vmbreak;
+    vmcase(CLOSE)
+      closeUpvalues(stackTop - stack.begin() + instruction.regA());
+      vmbreak;
+    vmcase(MOV)
       assert(stackTop + instruction.regA() <= stack.end());
       assert(stackTop + instruction.regD() <= stack.end());
       stackTop[instruction.regA()] = stackTop[instruction.regD()];
-      break;
-    case opCode::PRIMITIVE:
+      vmbreak;
+    vmcase(PRIMITIVE) {
       assert(stackTop + instruction.regA() <= stack.end());
       auto prim = instruction.regD();
       switch (prim) {
@@ -96,10 +349,68 @@ bool MALState::State::eval(int) {
       default:
         assert(false);
       }
-      break;
+      vmbreak;
+    }
+    BINOP_RR(ADD, Add)
+    BINOP_RR(SUB, Sub)
+    BINOP_RR(MUL, Mul)
+    BINOP_RR(DIV, Div)
+    BINOP_RR(LT, Lt)
+    BINOP_RR(LE, Le)
+    BINOP_RR(EQ, Eq)
+    BINOP_RK(ADDK, Add)
+    BINOP_RK(SUBK, Sub)
+    BINOP_RK(MULK, Mul)
+    BINOP_RK(DIVK, Div)
+    BINOP_RK(LTK, Lt)
+    BINOP_RK(LEK, Le)
+    BINOP_RK(GTK, Gt)
+    BINOP_RK(GEK, Ge)
+    BINOP_RK(EQK, Eq)
+    vmcase(RETURN) {
+      assert(stackTop + instruction.regA() <= stack.end());
+      PROFILE_POINT();
+      closeUpvalues(frames.back().base);
+      if (frames.size() == entryFrames + 1) {
+        // The top level leaves its result where the caller asked for it.
+        frames.pop_back();
+        INSTRUMENT(stats.stop(heap.allocations));
+        return true;
+      }
+      stackTop[-1] = stackTop[instruction.regA()];
+    returnToCaller:
+      ip = frames.back().ip;
+      frames.pop_back();
+      auto &caller = frames.back();
+      stackTop = stack.begin() + caller.base;
+      closure = static_cast<MALClosure *>(caller.fn.asObj());
+      chunk = closure->proto->chunk.get();
+      if (heap.shouldCollect()) {
+        collectGarbage();
+      }
+      vmbreak;
+    }
     }
   }
-  return true;
+
+unwind:
+  // Errors are located at the instruction that raised them, or at the call
+  // of the builtin that did. One from a nested run is located already.
+  if (error && error->location.empty() && chunk->file &&
+      ip > chunk->code.data()) {
+    if (auto line = chunk->lineAt((size_t)(ip - chunk->code.data()) - 1)) {
+      error->location = *chunk->file + ":" + std::to_string(line);
+    }
+  }
+  closeUpvalues(entryTop);
+  stackTop = stack.begin() + entryTop;
+  frames.resize(entryFrames);
+  INSTRUMENT(stats.stop(heap.allocations));
+  return false;
 }
 
+#ifdef THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
 bool MALState::eval(int r) { return state->eval(r); }
@@ -1,37 +1,96 @@
 #include "mal.hpp"
 
+#include <cstring>
 #include <iostream>
 #include <string>
 
-static std::string rep(MALState &state, std::string &str) {
+// Leaves the printed result, or the error, in out.
+static void rep(MALState &state, std::string &str, std::string &out) {
   int reg = 0;
-  if (!state.read_str(str, reg)) {
-    auto ret = state.get_error();
+  if (!state.read_str(str, reg) || !state.compile(reg) || !state.eval(reg)) {
+    out = state.get_error();
     state.clear_error();
-    return ret;
+    return;
   }
-  if (!state.compile(reg)) {
-    auto ret = state.get_error();
-    state.clear_error();
-    return ret;
-  }
-  if (!state.eval(reg)) {
-    auto ret = state.get_error();
-    state.clear_error();
-    return ret;
+  state.print_str(reg, out);
+}
+
+// Writes the profile, reporting any error.
+static bool stopProfile(MALState &state, const char *path) {
+  if (!state.stop_profile(path)) {
+    std::cerr << state.get_error() << "\n";
+    return false;
   }
-  return state.print_str(reg);
+  return true;
+}
+
+static int usage(const char *name) {
+  std::cerr << "Usage: " << name
+            << " [--no-opt] [--restore snapshot] [--compile image]"
+               " [--save snapshot] [--profile stacks] [file]\n";
+  return 1;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
   MALState state;
   std::string str;
+  const char *file = nullptr;
+  const char *image = nullptr;
+  const char *restore = nullptr;
+  const char *save = nullptr;
+  const char *profile = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--no-opt") == 0) {
+      state.set_optimize(false);
+    } else if (std::strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+      image = argv[++i];
+    } else if (std::strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+      restore = argv[++i];
+    } else if (std::strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+      save = argv[++i];
+    } else if (std::strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profile = argv[++i];
+    } else if (!file && argv[i][0] != '-') {
+      file = argv[i];
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if ((image || save) && !file) {
+    return usage(argv[0]);
+  }
+
+  if (restore && !state.restore_snapshot(restore)) {
+    std::cerr << state.get_error() << "\n";
+    return 1;
+  }
+  if (profile && !state.start_profile()) {
+    std::cerr << state.get_error() << "\n";
+    return 1;
+  }
+  if (file) {
+    if (!(image ? state.compile_file(file, image) : state.load_file(file)) ||
+        (save && !state.save_snapshot(save))) {
+      std::cerr << state.get_error() << "\n";
+      if (profile) {
+        state.clear_error();
+        stopProfile(state, profile);
+      }
+      return 1;
+    }
+    return profile && !stopProfile(state, profile);
+  }
 
+  std::string out;
   std::cout << "user> ";
 
   while (std::getline(std::cin, str)) {
-    std::cout << rep(state, str) << "\n";
-    std::cout << "user> ";
+    out.clear();
+    rep(state, str, out);
+    out += "\nuser> ";
+    std::cout << out;
   }
   std::cout << "\n";
+  return profile && !stopProfile(state, profile);
 }